@@ -10,6 +10,16 @@ Args::Args()
       use_vulkan_(true),
       blue_noise_size_(32),
       threads_(4),
+      kernel_radius_(0),
+      kernel_tolerance_(1.0e-5F),
+      filter_mode_(dither::filter_mode::Auto),
+      complement_energy_(true),
+      fixed_point_(false),
+      initial_pattern_(dither::initial_pattern::WhiteNoise),
+      parallel_swaps_(false),
+      rank_batch_(1),
+      tiled_layout_(false),
+      cl_devices_(),
       output_filename_("output.png") {}
 
 void Args::DisplayHelp() {
@@ -23,13 +33,41 @@ void Args::DisplayHelp() {
                "default)\n"
                "  -t <int> | --threads <int>\t\tUse CPU thread count when "
                "not using "
-               "OpenCL\n"
+               "OpenCL\n\t\t\t\t\t(0 uses all hardware threads)\n"
                "  -o <filename> | --output <filename>\tOutput filename to "
                "use\n"
                "  --overwrite\t\t\t\tEnable overwriting of file (default "
                "disabled)\n"
                "  --usevulkan | --nousevulkan\t\t\tUse/Disable Vulkan (enabled "
-               "by default)\n";
+               "by default)\n"
+               "  --kernel-radius <int | auto | full>\tGaussian kernel radius "
+               "(default auto)\n"
+               "  --kernel-tolerance <float>\t\tLargest relative gaussian tap "
+               "cut off by\n\t\t\t\t\tthe auto kernel radius (default "
+               "0.00001)\n"
+               "  --filter-mode <auto | direct | fft | separable>\n"
+               "\t\t\t\t\tHow full filter recomputes are done "
+               "(default auto)\n"
+               "  --complement | --nocomplement\t\tDerive/Recompute the "
+               "energies for the last\n\t\t\t\t\thalf of the ranking "
+               "(derived by default)\n"
+               "  --fixedpoint | --nofixedpoint\t\tUse/Disable 32-bit "
+               "fixed-point energies on\n\t\t\t\t\tthe CPU (disabled by "
+               "default)\n"
+               "  --initial-pattern <white | coarse | poisson>\n"
+               "\t\t\t\t\tPattern the CPU engine starts from "
+               "(default white)\n"
+               "  --parallelswaps | --noparallelswaps\tUse/Disable parallel "
+               "rounds of swaps for\n\t\t\t\t\tthe CPU engine's first "
+               "phase (disabled by default)\n"
+               "  --rank-batch <int>\t\t\tMost pixels ranked per step, above "
+               "1 ranks\n\t\t\t\t\tapproximately (default 1)\n"
+               "  --tiled | --notiled\t\t\tUse/Disable 8x8 tiles for the CPU "
+               "engine's\n\t\t\t\t\tenergies (disabled by default)\n"
+               "  --cl-device <int>[,<int>...]\t\tOpenCL devices to use, by "
+               "the index printed\n\t\t\t\t\tat startup, several split "
+               "the rows between\n\t\t\t\t\tthem (default the first "
+               "GPU, else the\n\t\t\t\t\tfirst device)\n";
 }
 
 bool Args::ParseArgs(int argc, char **argv) {
@@ -58,8 +96,9 @@ bool Args::ParseArgs(int argc, char **argv) {
       ++argv;
     } else if (argc > 1 && (std::strcmp(argv[0], "-t") == 0 ||
                             std::strcmp(argv[0], "--threads") == 0)) {
-      threads_ = std::strtoul(argv[1], nullptr, 10);
-      if (threads_ == 0) {
+      char *end = nullptr;
+      threads_ = std::strtoul(argv[1], &end, 10);
+      if (end == argv[1] || *end != 0) {
         std::cout << "ERROR: Failed to parse thread count, using 4 by "
                      "default"
                   << std::endl;
@@ -72,6 +111,109 @@ bool Args::ParseArgs(int argc, char **argv) {
       output_filename_ = std::string(argv[1]);
       --argc;
       ++argv;
+    } else if (argc > 1 && std::strcmp(argv[0], "--kernel-radius") == 0) {
+      if (std::strcmp(argv[1], "auto") == 0) {
+        kernel_radius_ = 0;
+      } else if (std::strcmp(argv[1], "full") == 0) {
+        kernel_radius_ = -1;
+      } else {
+        kernel_radius_ = std::strtol(argv[1], nullptr, 10);
+        if (kernel_radius_ <= 0) {
+          std::cout << "ERROR: Failed to parse kernel radius, using auto by "
+                       "default"
+                    << std::endl;
+          kernel_radius_ = 0;
+        }
+      }
+      --argc;
+      ++argv;
+    } else if (argc > 1 &&
+               std::strcmp(argv[0], "--kernel-tolerance") == 0) {
+      kernel_tolerance_ = std::strtof(argv[1], nullptr);
+      if (kernel_tolerance_ <= 0.0F || kernel_tolerance_ >= 1.0F) {
+        std::cout << "ERROR: Kernel tolerance must be between 0 and 1, using "
+                     "0.00001 by default"
+                  << std::endl;
+        kernel_tolerance_ = 1.0e-5F;
+      }
+      --argc;
+      ++argv;
+    } else if (argc > 1 && std::strcmp(argv[0], "--filter-mode") == 0) {
+      if (std::strcmp(argv[1], "auto") == 0) {
+        filter_mode_ = dither::filter_mode::Auto;
+      } else if (std::strcmp(argv[1], "direct") == 0) {
+        filter_mode_ = dither::filter_mode::Direct;
+      } else if (std::strcmp(argv[1], "fft") == 0) {
+        filter_mode_ = dither::filter_mode::FFT;
+      } else if (std::strcmp(argv[1], "separable") == 0) {
+        filter_mode_ = dither::filter_mode::Separable;
+      } else {
+        std::cout << "ERROR: Invalid filter mode, using auto by default"
+                  << std::endl;
+        filter_mode_ = dither::filter_mode::Auto;
+      }
+      --argc;
+      ++argv;
+    } else if (argc > 1 && std::strcmp(argv[0], "--initial-pattern") == 0) {
+      if (std::strcmp(argv[1], "white") == 0) {
+        initial_pattern_ = dither::initial_pattern::WhiteNoise;
+      } else if (std::strcmp(argv[1], "coarse") == 0) {
+        initial_pattern_ = dither::initial_pattern::CoarseToFine;
+      } else if (std::strcmp(argv[1], "poisson") == 0) {
+        initial_pattern_ = dither::initial_pattern::PoissonDisk;
+      } else {
+        std::cout << "ERROR: Invalid initial pattern, using white by default"
+                  << std::endl;
+        initial_pattern_ = dither::initial_pattern::WhiteNoise;
+      }
+      --argc;
+      ++argv;
+    } else if (argc > 1 && std::strcmp(argv[0], "--rank-batch") == 0) {
+      rank_batch_ = std::strtol(argv[1], nullptr, 10);
+      if (rank_batch_ <= 0) {
+        std::cout << "ERROR: Failed to parse rank batch, using 1 by default"
+                  << std::endl;
+        rank_batch_ = 1;
+      }
+      --argc;
+      ++argv;
+    } else if (argc > 1 && std::strcmp(argv[0], "--cl-device") == 0) {
+      cl_devices_.clear();
+      const char *next = argv[1];
+      while (true) {
+        char *end = nullptr;
+        const long index = std::strtol(next, &end, 10);
+        if (end == next || index < 0 || (*end != 0 && *end != ',')) {
+          std::cout << "ERROR: Failed to parse OpenCL devices, using the "
+                       "default device"
+                    << std::endl;
+          cl_devices_.clear();
+          break;
+        }
+        cl_devices_.push_back(index);
+        if (*end == 0) {
+          break;
+        }
+        next = end + 1;
+      }
+      --argc;
+      ++argv;
+    } else if (std::strcmp(argv[0], "--tiled") == 0) {
+      tiled_layout_ = true;
+    } else if (std::strcmp(argv[0], "--notiled") == 0) {
+      tiled_layout_ = false;
+    } else if (std::strcmp(argv[0], "--parallelswaps") == 0) {
+      parallel_swaps_ = true;
+    } else if (std::strcmp(argv[0], "--noparallelswaps") == 0) {
+      parallel_swaps_ = false;
+    } else if (std::strcmp(argv[0], "--complement") == 0) {
+      complement_energy_ = true;
+    } else if (std::strcmp(argv[0], "--nocomplement") == 0) {
+      complement_energy_ = false;
+    } else if (std::strcmp(argv[0], "--fixedpoint") == 0) {
+      fixed_point_ = true;
+    } else if (std::strcmp(argv[0], "--nofixedpoint") == 0) {
+      fixed_point_ = false;
     } else if (std::strcmp(argv[0], "--usevulkan") == 0) {
       use_vulkan_ = true;
     } else if (std::strcmp(argv[0], "--nousevulkan") == 0) {
@@ -2,6 +2,9 @@
 #define DITHERING_ARG_PARSE_HPP_
 
 #include <string>
+#include <vector>
+
+#include "blue_noise.hpp"
 
 struct Args {
   Args();
@@ -17,6 +20,16 @@ struct Args {
   bool use_vulkan_;
   unsigned int blue_noise_size_;
   unsigned int threads_;
+  int kernel_radius_;
+  float kernel_tolerance_;
+  dither::filter_mode filter_mode_;
+  bool complement_energy_;
+  bool fixed_point_;
+  dither::initial_pattern initial_pattern_;
+  bool parallel_swaps_;
+  int rank_batch_;
+  bool tiled_layout_;
+  std::vector<int> cl_devices_;
   std::string output_filename_;
 };
 
@@ -1,45 +1,231 @@
-int twoToOne(int x, int y, int width, int height) {
-  while (x < 0) {
-    x += width;
-  }
-  while (y < 0) {
-    y += height;
-  }
-  x = x % width;
-  y = y % height;
-  return x + y * width;
-}
-
 // float gaussian(float x, float y) {
 //     return exp(-(x*x + y*y) / (1.5F * 1.5F * 2.0F));
 // }
 
+// "precomputed" is the folded quadrant of the kernel, the tap at offset
+// (dx, dy) from the center is at |dy| * (filter_size / 2 + 1) + |dx|.
+// "filter_out" holds only the "row_count" rows starting at "first_row", the
+// part of the energies this device computes, and "pbp" the whole pattern.
 __kernel void do_filter(__global float *filter_out,
                         __global const float *precomputed,
                         __global const int *pbp, const int width,
-                        const int height, const int filter_size) {
+                        const int height, const int filter_size,
+                        const int first_row, const int row_count) {
   int i = get_global_id(0);
-  if (i < 0 || i >= width * height) {
+  if (i < 0 || i >= width * row_count) {
     return;
   }
 
   int x = i % width;
-  int y = i / width;
+  int y = first_row + i / width;
 
+  // Wrap the window's first row and column once, stepping through the window
+  // then only needs a compare and reset instead of a modulo per tap.
+  int first_column = (x - filter_size / 2) % width;
+  if (first_column < 0) {
+    first_column += width;
+  }
+  int row = (y - filter_size / 2) % height;
+  if (row < 0) {
+    row += height;
+  }
+
+  int radius = filter_size / 2;
   float sum = 0.0F;
   for (int q = 0; q < filter_size; ++q) {
-    int q_prime = height - filter_size / 2 + y + q;
+    __global const int *pbp_row = pbp + row * width;
+    __global const float *precomputed_row =
+        precomputed + abs(q - radius) * (radius + 1);
+    int column = first_column;
     for (int p = 0; p < filter_size; ++p) {
-      int p_prime = width - filter_size / 2 + x + p;
-      if (pbp[twoToOne(p_prime, q_prime, width, height)] != 0) {
-        sum += precomputed[twoToOne(p, q, filter_size, filter_size)];
+      if (pbp_row[column] != 0) {
+        sum += precomputed_row[abs(p - radius)];
         // sum += gaussian(p - filter_size / 2.0F + 0.5F, q -
         // filter_size / 2.0F + 0.5F);
       }
+      if (++column == width) {
+        column = 0;
+      }
+    }
+    if (++row == height) {
+      row = 0;
     }
   }
 
   filter_out[i] = sum;
 }
 
+// Each of the first "change_count" entries of "changes" is an index times two
+// plus the new value of that pixel.
+__kernel void update_pbp(__global int *pbp, __global const int *changes,
+                         const int change_count) {
+  int i = get_global_id(0);
+  if (i >= change_count) {
+    return;
+  }
+  pbp[changes[i] >> 1] = changes[i] & 1;
+}
+
+// Adds the kernel around the pixel of changes[change] (see update_pbp) to
+// "filter_out" if its new value is 1, or subtracts it if 0, which is what
+// do_filter would produce after the toggle. One work item per pixel of the
+// window, a window larger than the image folds onto itself so no two work
+// items write the same pixel. Rows outside the device's part of the energies
+// (see do_filter) are skipped.
+__kernel void splat(__global float *filter_out,
+                    __global const float *precomputed,
+                    __global const int *changes, const int change,
+                    const int width, const int height, const int filter_size,
+                    const int first_row, const int row_count) {
+  int window_width = min(filter_size, width);
+  int window_height = min(filter_size, height);
+  int i = get_global_id(0);
+  if (i >= window_width * window_height) {
+    return;
+  }
+
+  int dx = i % window_width;
+  int dy = i / window_width;
+  int idx = changes[change] >> 1;
+  float sign = (changes[change] & 1) != 0 ? 1.0F : -1.0F;
+  int radius = filter_size / 2;
+  int x = (idx % width - radius + dx) % width;
+  if (x < 0) {
+    x += width;
+  }
+  int y = (idx / width - radius + dy) % height;
+  if (y < 0) {
+    y += height;
+  }
+  if (y < first_row || y >= first_row + row_count) {
+    return;
+  }
+
+  // The kernel is symmetric, the tap at (p, q) of the window reaches the
+  // same offset from the toggled pixel as do_filter's tap at
+  // (filter_size - 1 - p, filter_size - 1 - q).
+  float sum = 0.0F;
+  for (int q = dy; q < filter_size; q += height) {
+    __global const float *precomputed_row =
+        precomputed + abs(q - radius) * (radius + 1);
+    for (int p = dx; p < filter_size; p += width) {
+      sum += precomputed_row[abs(p - radius)];
+    }
+  }
+  filter_out[x + (y - first_row) * width] += sign * sum;
+}
+
+// The reductions below keep four (value, index) pairs, the min and the max
+// energy among pixels with pbp 0, then the same for pbp 1. An index of -1
+// means no pixel yet, ties go to the lowest index.
+bool minmax_better(float value, int index, float best_value, int best_index,
+                   bool want_max) {
+  if (index < 0) {
+    return false;
+  }
+  if (best_index < 0) {
+    return true;
+  }
+  if (value != best_value) {
+    return want_max ? value > best_value : value < best_value;
+  }
+  return index < best_index;
+}
+
+// Merges the local pairs of every work item into the first entry of each of
+// the four "values" and "indices" runs of get_local_size(0) entries. The
+// local size must be a power of two.
+void minmax_reduce_local(__local float *values, __local int *indices) {
+  int lid = get_local_id(0);
+  int lsize = get_local_size(0);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int stride = lsize / 2; stride > 0; stride /= 2) {
+    if (lid < stride) {
+      for (int c = 0; c < 4; ++c) {
+        int a = c * lsize + lid;
+        int b = a + stride;
+        if (minmax_better(values[b], indices[b], values[a], indices[a],
+                          c % 2 == 1)) {
+          values[a] = values[b];
+          indices[a] = indices[b];
+        }
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+// First pass, each work group writes its four pairs to entries
+// group * 4 + c of "partial_values" and "partial_indices". "filter" holds the
+// "count" energies of pixels "first" onwards (see do_filter), the indices are
+// those of the whole image.
+__kernel void minmax_partial(__global const float *filter,
+                             __global const int *pbp, const int first,
+                             const int count, __global float *partial_values,
+                             __global int *partial_indices,
+                             __local float *values, __local int *indices) {
+  float best_values[4] = {0.0F, 0.0F, 0.0F, 0.0F};
+  int best_indices[4] = {-1, -1, -1, -1};
+  for (int i = get_global_id(0); i < count; i += get_global_size(0)) {
+    int idx = first + i;
+    int c = pbp[idx] != 0 ? 2 : 0;
+    if (minmax_better(filter[i], idx, best_values[c], best_indices[c],
+                      false)) {
+      best_values[c] = filter[i];
+      best_indices[c] = idx;
+    }
+    if (minmax_better(filter[i], idx, best_values[c + 1], best_indices[c + 1],
+                      true)) {
+      best_values[c + 1] = filter[i];
+      best_indices[c + 1] = idx;
+    }
+  }
+
+  int lid = get_local_id(0);
+  int lsize = get_local_size(0);
+  for (int c = 0; c < 4; ++c) {
+    values[c * lsize + lid] = best_values[c];
+    indices[c * lsize + lid] = best_indices[c];
+  }
+  minmax_reduce_local(values, indices);
+  if (lid == 0) {
+    for (int c = 0; c < 4; ++c) {
+      partial_values[get_group_id(0) * 4 + c] = values[c * lsize];
+      partial_indices[get_group_id(0) * 4 + c] = indices[c * lsize];
+    }
+  }
+}
+
+// Second pass, run as a single work group over the "partial_count" groups of
+// minmax_partial. Writes the four pairs to "out_values" and "out_indices".
+__kernel void minmax_final(__global const float *partial_values,
+                           __global const int *partial_indices,
+                           const int partial_count,
+                           __global float *out_values,
+                           __global int *out_indices, __local float *values,
+                           __local int *indices) {
+  int lid = get_local_id(0);
+  int lsize = get_local_size(0);
+  for (int c = 0; c < 4; ++c) {
+    float best_value = 0.0F;
+    int best_index = -1;
+    for (int g = lid; g < partial_count; g += lsize) {
+      if (minmax_better(partial_values[g * 4 + c], partial_indices[g * 4 + c],
+                        best_value, best_index, c % 2 == 1)) {
+        best_value = partial_values[g * 4 + c];
+        best_index = partial_indices[g * 4 + c];
+      }
+    }
+    values[c * lsize + lid] = best_value;
+    indices[c * lsize + lid] = best_index;
+  }
+  minmax_reduce_local(values, indices);
+  if (lid == 0) {
+    for (int c = 0; c < 4; ++c) {
+      out_values[c] = values[c * lsize];
+      out_indices[c] = indices[c * lsize];
+    }
+  }
+}
+
 // vim: syntax=c
@@ -4,16 +4,24 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <random>
+#include <sstream>
 #include <string>
 #include <unordered_set>
 
+#include "fft.hpp"
+
 #if DITHERING_OPENCL_ENABLED == 1
 #include <CL/opencl.h>
+
+#include "blue_noise_cl.hpp"
 #endif
 
 #if DITHERING_VULKAN_ENABLED == 1
@@ -270,7 +278,7 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
     VkCommandBuffer command_buffer, VkCommandPool command_pool, VkQueue queue,
     VkBuffer pbp_buf, VkPipeline pipeline, VkPipelineLayout pipeline_layout,
     VkDescriptorSet descriptor_set, VkBuffer filter_out_buf, const int width,
-    const int height) {
+    const int height, const Options &options) {
   const int size = width * height;
   const int pixel_count = size * 4 / 10;
   const int local_size = 256;
@@ -382,6 +390,8 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
 #ifndef NDEBUG
   int iterations = 0;
 #endif
+  internal::MinMaxCache minmax_cache(
+      width, height, internal::get_filter_size(width, height, options));
 
   std::cout << "Begin BinaryArray generation loop\n";
   while (true) {
@@ -401,10 +411,10 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
     }
 
     int min, max;
-    std::tie(min, max) =
-        internal::filter_minmax_raw_array(filter_mapped_float, size, pbp);
+    std::tie(min, max) = minmax_cache.minmax(filter_mapped_float, pbp);
 
     pbp[max] = false;
+    minmax_cache.toggled(max, false);
 
     changed_indices.push_back(max);
 
@@ -422,14 +432,16 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
     // get second buffer's min
     int second_min;
     std::tie(second_min, std::ignore) =
-        internal::filter_minmax_raw_array(filter_mapped_float, size, pbp);
+        minmax_cache.minmax(filter_mapped_float, pbp);
 
     if (second_min == max) {
       pbp[max] = true;
+      minmax_cache.toggled(max, true);
       changed_indices.push_back(max);
       break;
     } else {
       pbp[second_min] = true;
+      minmax_cache.toggled(second_min, true);
       changed_indices.push_back(second_min);
     }
 
@@ -489,10 +501,60 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
 #endif
   std::vector<unsigned int> dither_array(size, 0);
   int min, max;
+
+  // Approximate ranking, see internal::RankBatchPicker. Each step filters
+  // once for all of its picks.
+  const bool batched = options.rank_batch > 1;
+  const internal::Torus torus(
+      width, height, internal::get_filter_size(width, height, options));
+  const std::vector<float> taps =
+      internal::precompute_gaussian(torus.filter_size());
+  internal::RankBatchPicker picker;
+  std::vector<int> picks;
+  int batch_steps = 0;
+  int out_of_order = 0;
+  // Ranks "remaining" pixels starting at "rank" and counting towards
+  // "direction", setting each to the inverse of "candidate_value".
+  const auto rank_batched = [&](int rank, int remaining, int direction,
+                                bool candidate_value, bool want_max,
+                                float complement_mass) {
+    picker.invalidate_all();
+    while (remaining > 0) {
+      vulkan_get_filter(device, phys_atom_size, command_buffer, command_pool,
+                        queue, pbp_buf, pipeline, pipeline_layout,
+                        descriptor_set, filter_out_buf, size, pbp, reversed_pbp,
+                        global_size, pbp_mapped_int, staging_pbp_buffer,
+                        staging_pbp_buffer_mem, staging_filter_buffer_mem,
+                        staging_filter_buffer, &changed_indices);
+      if (complement_mass > 0.0F) {
+        internal::complement_filter(filter_mapped_float, size,
+                                    complement_mass);
+      }
+      const int set_count = direction < 0 ? rank + 1 : rank;
+      out_of_order += picker.pick(
+          torus, filter_mapped_float, pbp, candidate_value, want_max,
+          internal::rank_batch_separation(
+              size, std::min(set_count, size - set_count), torus.filter_size()),
+          std::min(options.rank_batch, remaining), taps, nullptr, picks);
+      ++batch_steps;
+      for (int idx : picks) {
+        pbp.at(idx) = !candidate_value;
+        dither_array.at(idx) = rank;
+        changed_indices.push_back(idx);
+        rank += direction;
+        --remaining;
+      }
+    }
+  };
+
   {
     std::vector<bool> pbp_copy(pbp);
     std::cout << "Ranking minority pixels...\n";
-    for (unsigned int i = pixel_count; i-- > 0;) {
+    if (batched) {
+      rank_batched(pixel_count - 1, pixel_count, -1, true, true, 0.0F);
+    }
+    minmax_cache.invalidate();
+    for (unsigned int i = batched ? 0 : pixel_count; i-- > 0;) {
 #ifndef NDEBUG
       std::cout << i << ' ';
 #endif
@@ -503,8 +565,9 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
                         staging_pbp_buffer_mem, staging_filter_buffer_mem,
                         staging_filter_buffer, &changed_indices);
       std::tie(std::ignore, max) =
-          internal::filter_minmax_raw_array(filter_mapped_float, size, pbp);
+          minmax_cache.minmax(filter_mapped_float, pbp);
       pbp.at(max) = false;
+      minmax_cache.toggled(max, false);
       dither_array.at(max) = i;
       changed_indices.push_back(max);
 #ifndef NDEBUG
@@ -516,13 +579,22 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
 #endif
     }
     pbp = pbp_copy;
+    // Every ranked pixel was restored, upload the whole pattern next.
+    changed_indices.clear();
 #ifndef NDEBUG
     image::Bl min_pixels = internal::rangeToBl(dither_array, width);
     min_pixels.writeToFile(image::file_type::PNG, true, "da_min_pixels.png");
 #endif
   }
   std::cout << "\nRanking remainder of first half of pixels...\n";
-  for (unsigned int i = pixel_count; i < (unsigned int)((size + 1) / 2); ++i) {
+  if (batched) {
+    rank_batched(pixel_count, (size + 1) / 2 - pixel_count, 1, false, false,
+                 0.0F);
+  }
+  // The pattern was restored after ranking the minority pixels.
+  minmax_cache.invalidate();
+  for (unsigned int i = batched ? (size + 1) / 2 : pixel_count;
+       i < (unsigned int)((size + 1) / 2); ++i) {
 #ifndef NDEBUG
     std::cout << i << ' ';
 #endif
@@ -532,9 +604,9 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
                       pbp_mapped_int, staging_pbp_buffer,
                       staging_pbp_buffer_mem, staging_filter_buffer_mem,
                       staging_filter_buffer, &changed_indices);
-    std::tie(min, std::ignore) =
-        internal::filter_minmax_raw_array(filter_mapped_float, size, pbp);
+    std::tie(min, std::ignore) = minmax_cache.minmax(filter_mapped_float, pbp);
     pbp.at(min) = true;
+    minmax_cache.toggled(min, true);
     dither_array.at(min) = i;
     changed_indices.push_back(min);
 #ifndef NDEBUG
@@ -562,13 +634,30 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
   }
 #endif
   std::cout << "\nRanking last half of pixels...\n";
-  reversed_pbp = true;
+  // With complement_energy the device keeps filtering the pattern itself, so
+  // its copy of the pattern stays valid and only changed pixels are uploaded.
+  const float mass =
+      options.complement_energy
+          ? internal::kernel_mass(internal::precompute_gaussian(
+                internal::get_filter_size(width, height, options)))
+          : 0.0F;
+  reversed_pbp = !options.complement_energy;
   bool first_reversed_run = true;
-  for (unsigned int i = (size + 1) / 2; i < (unsigned int)size; ++i) {
+  if (batched) {
+    if (reversed_pbp) {
+      changed_indices.clear();
+    }
+    rank_batched((size + 1) / 2, size - (size + 1) / 2, 1, false, true, mass);
+    internal::print_rank_batch_stats(size, batch_steps, out_of_order);
+  }
+  // Every energy changes with the reversed pattern or the complement.
+  minmax_cache.invalidate();
+  for (unsigned int i = batched ? size : (size + 1) / 2;
+       i < (unsigned int)size; ++i) {
 #ifndef NDEBUG
     std::cout << i << ' ';
 #endif
-    if (first_reversed_run) {
+    if (first_reversed_run && reversed_pbp) {
       changed_indices.clear();
       first_reversed_run = false;
     }
@@ -578,9 +667,12 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
                       pbp_mapped_int, staging_pbp_buffer,
                       staging_pbp_buffer_mem, staging_filter_buffer_mem,
                       staging_filter_buffer, &changed_indices);
-    std::tie(std::ignore, max) =
-        internal::filter_minmax_raw_array(filter_mapped_float, size, pbp);
+    if (options.complement_energy) {
+      internal::complement_filter(filter_mapped_float, size, mass);
+    }
+    std::tie(std::ignore, max) = minmax_cache.minmax(filter_mapped_float, pbp);
     pbp.at(max) = true;
+    minmax_cache.toggled(max, true);
     dither_array.at(max) = i;
     changed_indices.push_back(max);
 #ifndef NDEBUG
@@ -601,6 +693,9 @@ std::vector<unsigned int> dither::internal::blue_noise_vulkan_impl(
                       pbp_mapped_int, staging_pbp_buffer,
                       staging_pbp_buffer_mem, staging_filter_buffer_mem,
                       staging_filter_buffer, nullptr);
+    if (options.complement_energy) {
+      internal::complement_filter(filter_mapped_float, size, mass);
+    }
     internal::write_filter(vulkan_buf_to_vec(filter_mapped_float, size), width,
                            "filter_after.pgm");
     image::Bl pbp_image = toBl(pbp, width);
@@ -624,86 +719,97 @@ std::vector<float> dither::internal::vulkan_buf_to_vec(float *mapped,
 
 #include "image.hpp"
 
+dither::Options::Options()
+    : kernel_radius(0),
+      kernel_tolerance(1.0e-5F),
+      filter(filter_mode::Auto),
+      complement_energy(true),
+      fixed_point(false),
+      initial(initial_pattern::WhiteNoise),
+      parallel_swaps(false),
+      rank_batch(1),
+      tiled_layout(false),
+      cl_devices() {}
+
 image::Bl dither::blue_noise(int width, int height, int threads,
-                             bool use_opencl, bool use_vulkan) {
+                             bool use_opencl, bool use_vulkan,
+                             const Options &options) {
+  std::cout << "Using gaussian kernel of size "
+            << internal::get_filter_size(width, height, options) << std::endl;
 #if DITHERING_OPENCL_ENABLED == 1
   if (use_opencl) {
     // try to use OpenCL
     do {
-      cl_device_id device;
-      cl_context context;
-      cl_program program;
-      cl_int err;
+      int filter_size = internal::get_filter_size(width, height, options);
 
-      cl_platform_id platform;
-
-      int filter_size = (width + height) / 2;
-
-      err = clGetPlatformIDs(1, &platform, nullptr);
-      if (err != CL_SUCCESS) {
-        std::cerr << "OpenCL: Failed to identify a platform\n";
+      const std::vector<cl_device_id> all_devices =
+          internal::cl_list_devices();
+      if (all_devices.empty()) {
+        std::cerr << "OpenCL: Failed to get a device\n";
         break;
       }
+      int first_gpu = -1;
+      for (std::size_t i = 0; i < all_devices.size() && first_gpu < 0; ++i) {
+        cl_device_type type = 0;
+        if (clGetDeviceInfo(all_devices[i], CL_DEVICE_TYPE, sizeof(type),
+                            &type, nullptr) == CL_SUCCESS &&
+            (type & CL_DEVICE_TYPE_GPU)) {
+          first_gpu = i;
+        }
+      }
 
-      err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, nullptr);
-      if (err != CL_SUCCESS) {
-        std::cerr << "OpenCL: Failed to get a device\n";
+      std::vector<int> selected = options.cl_devices;
+      if (selected.empty()) {
+        selected.push_back(first_gpu >= 0 ? first_gpu : 0);
+      }
+      bool valid = (int)selected.size() <= height;
+      for (std::size_t i = 0; i < selected.size() && valid; ++i) {
+        valid = selected[i] >= 0 && selected[i] < (int)all_devices.size() &&
+                std::find(selected.begin(), selected.begin() + i,
+                          selected[i]) == selected.begin() + i;
+      }
+      if (!valid) {
+        std::cerr << "OpenCL: Invalid device selection, expected up to "
+                  << height << " distinct devices out of "
+                  << all_devices.size() << "\n";
         break;
       }
 
-      context = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &err);
-
-      {
-        char buf[1024];
-        std::ifstream program_file("src/blue_noise.cl");
-        if (!program_file.good()) {
-          std::cerr << "ERROR: Failed to read \"src/blue_noise.cl\" "
-                       "(not found?)\n";
-          break;
-        }
-        std::string program_string;
-        while (program_file.good()) {
-          program_file.read(buf, 1024);
-          if (int read_count = program_file.gcount(); read_count > 0) {
-            program_string.append(buf, read_count);
-          }
-        }
-
-        const char *string_ptr = program_string.c_str();
-        std::size_t program_size = program_string.size();
-        program = clCreateProgramWithSource(
-            context, 1, (const char **)&string_ptr, &program_size, &err);
+      std::vector<internal::ClDevice> devices;
+      bool ready = true;
+      for (int index : selected) {
+        cl_int err;
+        internal::ClDevice device{all_devices[index], nullptr, nullptr};
+        device.context = clCreateContext(nullptr, 1, &device.device, nullptr,
+                                         nullptr, &err);
         if (err != CL_SUCCESS) {
-          std::cerr << "OpenCL: Failed to create the program\n";
-          clReleaseContext(context);
+          std::cerr << "OpenCL: Failed to create a context for device "
+                    << index << "\n";
+          ready = false;
           break;
         }
-
-        err = clBuildProgram(program, 1, &device, nullptr, nullptr, nullptr);
-        if (err != CL_SUCCESS) {
-          std::cerr << "OpenCL: Failed to build the program\n";
-
-          std::size_t log_size;
-          clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0,
-                                nullptr, &log_size);
-          std::unique_ptr<char[]> log = std::make_unique<char[]>(log_size + 1);
-          log[log_size] = 0;
-          clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size,
-                                log.get(), nullptr);
-          std::cerr << log.get() << std::endl;
-
-          clReleaseProgram(program);
-          clReleaseContext(context);
+        device.program = internal::build_cl_program(device.context,
+                                                    device.device);
+        if (device.program == nullptr) {
+          clReleaseContext(device.context);
+          ready = false;
           break;
         }
+        std::cout << "OpenCL: Using device " << index << std::endl;
+        devices.push_back(device);
       }
 
-      std::cout << "OpenCL: Initialized, trying cl_impl..." << std::endl;
-      std::vector<unsigned int> result = internal::blue_noise_cl_impl(
-          width, height, filter_size, context, device, program);
+      std::vector<unsigned int> result;
+      if (ready) {
+        std::cout << "OpenCL: Initialized, trying cl_impl..." << std::endl;
+        result = internal::blue_noise_cl_impl(width, height, filter_size,
+                                              devices, options);
+      }
 
-      clReleaseProgram(program);
-      clReleaseContext(context);
+      for (const internal::ClDevice &device : devices) {
+        clReleaseProgram(device.program);
+        clReleaseContext(device.context);
+      }
 
       if (!result.empty()) {
         return internal::rangeToBl(result, width);
@@ -1111,8 +1217,10 @@ image::Bl dither::blue_noise(int width, int height, int threads,
         },
         &command_pool);
 
-    int filter_size = (width + height) / 2;
-    std::vector<float> precomputed = internal::precompute_gaussian(filter_size);
+    int filter_size = internal::get_filter_size(width, height, options);
+    // The shader reads the folded quadrant of the kernel.
+    std::vector<float> precomputed = internal::fold_kernel(
+        internal::precompute_gaussian(filter_size), filter_size);
     VkDeviceSize precomputed_size = sizeof(float) * precomputed.size();
     VkDeviceSize filter_out_size = sizeof(float) * width * height;
     VkDeviceSize pbp_size = sizeof(int) * width * height;
@@ -1396,7 +1504,7 @@ image::Bl dither::blue_noise(int width, int height, int threads,
     auto result = dither::internal::blue_noise_vulkan_impl(
         device, phys_device, command_buffer, command_pool, compute_queue,
         pbp_buf, compute_pipeline, compute_pipeline_layout,
-        compute_descriptor_set, filter_out_buf, width, height);
+        compute_descriptor_set, filter_out_buf, width, height, options);
     if (!result.empty()) {
       return internal::rangeToBl(result, width);
     }
@@ -1411,20 +1519,210 @@ ENDOF_VULKAN:
   std::cout << "Vulkan/OpenCL: Failed to setup/use or is not enabled, using "
                "regular impl..."
             << std::endl;
-  return internal::rangeToBl(internal::blue_noise_impl(width, height, threads),
-                             width);
+  return internal::blue_noise_impl(width, height, threads, options);
 }
 
-std::vector<unsigned int> dither::internal::blue_noise_impl(int width,
-                                                            int height,
-                                                            int threads) {
-  int count = width * height;
-  std::vector<float> filter_out;
+namespace {
+struct KernelSpectrum {
+  KernelSpectrum(int width, int height)
+      : row_plan(width), column_plan(height), spectrum() {}
+
+  fft::Plan row_plan;
+  fft::Plan column_plan;
+  std::vector<std::complex<double>> spectrum;
+};
+
+/// "taps" are either float gaussian taps or fixed-point ones, each kind is
+/// cached separately.
+template <typename T>
+std::shared_ptr<const KernelSpectrum> get_kernel_spectrum(
+    int width, int height, int filter_size, const std::vector<T> &taps) {
+  static std::mutex cache_mutex;
+  static std::map<std::tuple<int, int, int, bool>,
+                  std::shared_ptr<const KernelSpectrum>>
+      cache;
+
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  auto key = std::make_tuple(width, height, filter_size,
+                             std::is_floating_point<T>::value);
+  if (auto iter = cache.find(key); iter != cache.end()) {
+    return iter->second;
+  }
+
+  auto kernel = std::make_shared<KernelSpectrum>(width, height);
+
+  // Wrap the kernel window onto the torus, taps landing on the same pixel
+  // add up just like they do in the direct compute_filter() path.
+  kernel->spectrum.assign(width * height, {0.0, 0.0});
+  for (int q = 0; q < filter_size; ++q) {
+    for (int p = 0; p < filter_size; ++p) {
+      kernel->spectrum[utility::twoToOne(p - filter_size / 2,
+                                         q - filter_size / 2, width, height)] +=
+          (double)taps[utility::twoToOne(p, q, filter_size, filter_size)];
+    }
+  }
+  fft::transform_2d(kernel->spectrum, kernel->row_plan, kernel->column_plan,
+                    false);
+
+  cache.emplace(key, kernel);
+  return kernel;
+}
+}  // namespace
+
+void dither::internal::compute_filter_fft(
+    const PatternView &pbp, int width, int height, int filter_size,
+    std::vector<float> &filter_out, const std::vector<float> *precomputed,
+    utility::ThreadPool *pool) {
+  if (filter_size % 2 == 0) {
+    ++filter_size;
+  }
+
+  std::shared_ptr<const KernelSpectrum> kernel;
+  if (precomputed) {
+    kernel = get_kernel_spectrum(width, height, filter_size, *precomputed);
+  } else {
+    kernel = get_kernel_spectrum(width, height, filter_size,
+                                 precompute_gaussian(filter_size));
+  }
+
+  std::vector<std::complex<double>> data(width * height);
+  for (int i = 0; i < width * height; ++i) {
+    data[i] = pbp[i] ? 1.0 : 0.0;
+  }
+  fft::transform_2d(data, kernel->row_plan, kernel->column_plan, false, pool);
+
+  // The filter sums the kernel around each pixel, which is a correlation, so
+  // multiply by the conjugate of the kernel spectrum.
+  for (int i = 0; i < width * height; ++i) {
+    data[i] *= std::conj(kernel->spectrum[i]);
+  }
+  fft::transform_2d(data, kernel->row_plan, kernel->column_plan, true, pool);
+
+  for (int i = 0; i < width * height; ++i) {
+    filter_out[i] = (float)data[i].real();
+  }
+}
+
+void dither::internal::compute_filter_fixed_fft(
+    const PatternView &pbp, int width, int height, int filter_size,
+    std::vector<std::int32_t> &filter_out,
+    const std::vector<std::int32_t> &taps, utility::ThreadPool *pool) {
+  if (filter_size % 2 == 0) {
+    ++filter_size;
+  }
+
+  std::shared_ptr<const KernelSpectrum> kernel =
+      get_kernel_spectrum(width, height, filter_size, taps);
+
+  std::vector<std::complex<double>> data(width * height);
+  for (int i = 0; i < width * height; ++i) {
+    data[i] = pbp[i] ? 1.0 : 0.0;
+  }
+  fft::transform_2d(data, kernel->row_plan, kernel->column_plan, false, pool);
+  for (int i = 0; i < width * height; ++i) {
+    data[i] *= std::conj(kernel->spectrum[i]);
+  }
+  fft::transform_2d(data, kernel->row_plan, kernel->column_plan, true, pool);
+
+  // The exact sums are integers below 2^30, far inside what the double
+  // transforms resolve, so rounding recovers them.
+  for (int i = 0; i < width * height; ++i) {
+    filter_out[i] = (std::int32_t)std::llround(data[i].real());
+  }
+}
+
+namespace {
+/// Seeds a pattern twice the size of "coarse", which has 40% of its pixels
+/// set. The 2x2 block under every set coarse pixel gets one pixel and every
+/// other block two diagonal ones, at random positions. That keeps the density
+/// at 40% and the even spread of the coarse pattern.
+dither::internal::Pattern upsample_pattern(
+    const dither::internal::Pattern &coarse, int coarse_width,
+    int coarse_height) {
+  const int width = coarse_width * 2;
+  std::vector<bool> pbp(coarse.size() * 4);
+  std::default_random_engine re(std::random_device{}());
+  std::uniform_int_distribution<int> dist(0, 3);
+
+  for (int y = 0; y < coarse_height; ++y) {
+    for (int x = 0; x < coarse_width; ++x) {
+      const int corner = dist(re);
+      const int dx = corner % 2;
+      const int dy = corner / 2;
+      pbp[(y * 2 + dy) * width + x * 2 + dx] = true;
+      if (!coarse[y * coarse_width + x]) {
+        pbp[(y * 2 + 1 - dy) * width + x * 2 + 1 - dx] = true;
+      }
+    }
+  }
+
+  return dither::internal::Pattern(pbp);
+}
+}  // namespace
+
+dither::internal::Pattern dither::internal::make_initial_pattern(
+    int width, int height, const Options &options, utility::ThreadPool &pool,
+    int *coarse_swaps) {
+  const int coarse_width = width / 2;
+  const int coarse_height = height / 2;
+  if (options.initial == initial_pattern::PoissonDisk) {
+    return Pattern(
+        poisson_disk_noise(width, height, width * height * 4 / 10));
+  } else if (options.initial != initial_pattern::CoarseToFine ||
+             width % 2 != 0 || height % 2 != 0 ||
+             coarse_width < coarse_min_size ||
+             coarse_height < coarse_min_size) {
+    return Pattern(random_noise(width * height, width * height * 4 / 10));
+  }
+
+  Pattern coarse = make_initial_pattern(coarse_width, coarse_height, options,
+                                        pool, coarse_swaps);
+
+  // Refine the coarse level with float energies. It only seeds the finer
+  // level, so the drift of skipping resyncs does not matter here.
+  const Torus torus(coarse_width, coarse_height,
+                    get_filter_size(coarse_width, coarse_height, options));
+  const std::vector<float> precomputed =
+      precompute_gaussian(torus.filter_size());
+  std::vector<float> filter_out(torus.size());
+  compute_filter(coarse, coarse_width, coarse_height, torus.filter_size(),
+                 filter_out, &precomputed, &pool, options.filter);
+  MinMaxTree tree(torus.size());
+  tree.rebuild(filter_out, coarse, &pool);
+  const int swaps = remove_clusters(tree, coarse, [&](int idx, bool value) {
+    coarse.set(idx, value);
+    update_filter(torus, filter_out, idx, precomputed, value);
+    for_each_filter_span(torus, idx, [&](int begin, int end) {
+      tree.update(filter_out, coarse, begin, end);
+    });
+  });
+  std::cout << "Refined the " << coarse_width << "x" << coarse_height
+            << " seed level in " << swaps << " swaps\n";
+  *coarse_swaps += swaps;
+
+  return upsample_pattern(coarse, coarse_width, coarse_height);
+}
+
+template <typename Geometry, typename Energy>
+std::vector<unsigned int> dither::internal::blue_noise_engine(
+    const Geometry &torus, int threads, const Options &options) {
+  const int width = torus.width();
+  const int height = torus.height();
+  const int count = torus.size();
+  std::vector<Energy> filter_out;
   filter_out.resize(count);
 
-  int pixel_count = count * 4 / 10;
-  std::vector<bool> pbp = random_noise(count, count * 4 / 10);
-  pbp.resize(count);
+  utility::ThreadPool pool(threads);
+  std::cout << "Using " << pool.size() << " CPU thread(s)\n";
+  std::cout << "Using " << simd::isa_name() << " CPU kernels\n";
+
+  int coarse_swaps = 0;
+  Pattern pbp =
+      make_initial_pattern(width, height, options, pool, &coarse_swaps);
+  if constexpr (Geometry::is_tiled) {
+    pbp = relayout_pattern(torus, pbp, false);
+  }
+  const int pixel_count = pbp.count();
 
 #ifndef NDEBUG
   printf("Inserting %d pixels into image of max count %d\n", pixel_count,
@@ -1434,90 +1732,144 @@ std::vector<unsigned int> dither::internal::blue_noise_impl(int width,
   fprintf(random_noise_image, "P1\n%d %d\n", width, height);
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x) {
-      fprintf(random_noise_image, "%d ",
-              pbp[utility::twoToOne(x, y, width, height)] ? 1 : 0);
+      fprintf(random_noise_image, "%d ", pbp[torus.index(x, y)] ? 1 : 0);
     }
     fputc('\n', random_noise_image);
   }
   fclose(random_noise_image);
 #endif
 
-  // #ifndef NDEBUG
-  int iterations = 0;
-  // #endif
-
-  int filter_size = (width + height) / 2;
+  const int filter_size = torus.filter_size();
 
   std::unique_ptr<std::vector<float>> precomputed =
       std::make_unique<std::vector<float>>(
           internal::precompute_gaussian(filter_size));
-
-  internal::compute_filter(pbp, width, height, count, filter_size, filter_out,
-                           precomputed.get(), threads);
-#ifndef NDEBUG
-  internal::write_filter(filter_out, width, "filter_out_start.pgm");
-#endif
-  std::cout << "Begin BinaryArray generation loop\n";
-  while (true) {
+  // Taps applied by incremental updates, in the energy representation.
+  const std::vector<Energy> taps = internal::kernel_taps<Energy>(*precomputed);
+  constexpr bool fixed_point = !std::is_floating_point<Energy>::value;
+  filter_mode mode = internal::resolve_filter_mode(options.filter, width,
+                                                   height, filter_size);
+  if (fixed_point && mode == filter_mode::Separable) {
+    // Quantized taps are not separable, only the direct and FFT paths are
+    // exact.
+    mode = filter_mode::Direct;
+  }
+  std::cout << "Energies are "
+            << (fixed_point ? "32-bit fixed-point" : "float") << '\n';
+  std::cout << "Full filter recomputes use the "
+            << (mode == filter_mode::FFT         ? "FFT"
+                : mode == filter_mode::Separable ? "separable"
+                                                 : "direct")
+            << " path\n";
+
+  // The full recomputes work on rows, a tiled torus goes through a
+  // row-major copy of the pattern and of the energies.
+  std::vector<Energy> row_major_filter;
 #ifndef NDEBUG
-    //        if(++iterations % 10 == 0) {
-    printf("Iteration %d\n", ++iterations);
-//        }
+  const auto to_row_major = [&]() -> const std::vector<Energy> & {
+    if constexpr (Geometry::is_tiled) {
+      row_major_filter.resize(count);
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+          row_major_filter[x + y * width] = filter_out[torus.index(x, y)];
+        }
+      }
+      return row_major_filter;
+    } else {
+      return filter_out;
+    }
+  };
 #endif
-    // get filter values
-    internal::compute_filter(pbp, width, height, count, filter_size, filter_out,
-                             precomputed.get(), threads);
-
-    // #ifndef NDEBUG
-    //         for(int i = 0; i < count; ++i) {
-    //             int x, y;
-    //             std::tie(x, y) = internal::oneToTwo(i, width);
-    //             printf("%d (%d, %d): %f\n", i, x, y, filter_out[i]);
-    //         }
-    // #endif
-
-    int min, max;
-    std::tie(min, max) = internal::filter_minmax(filter_out, pbp);
-
-    // remove 1
-    pbp[max] = false;
-
-    // get filter values again
-    internal::compute_filter(pbp, width, height, count, filter_size, filter_out,
-                             precomputed.get(), threads);
-
-    // get second buffer's min
-    int second_min;
-    std::tie(second_min, std::ignore) =
-        internal::filter_minmax(filter_out, pbp);
-
-    if (second_min == max) {
-      pbp[max] = true;
-      break;
+  const auto recompute = [&](const PatternView &view) {
+    Pattern row_major_pbp;
+    if constexpr (Geometry::is_tiled) {
+      row_major_pbp = internal::relayout_pattern(torus, view, true);
+      row_major_filter.resize(count);
+    }
+    const PatternView source = Geometry::is_tiled ? row_major_pbp : view;
+    std::vector<Energy> &out =
+        Geometry::is_tiled ? row_major_filter : filter_out;
+    if constexpr (fixed_point) {
+      internal::compute_filter_fixed(source, width, height, filter_size, out,
+                                     taps, &pool, mode);
     } else {
-      pbp[second_min] = true;
+      internal::compute_filter(source, width, height, filter_size, out,
+                               precomputed.get(), &pool, mode);
     }
-
-    if (iterations % 100 == 0) {
-      // generate blue_noise image from pbp
-#ifndef NDEBUG
-      FILE *blue_noise_image = fopen("blue_noise.pbm", "w");
-      fprintf(blue_noise_image, "P1\n%d %d\n", width, height);
+    if constexpr (Geometry::is_tiled) {
       for (int y = 0; y < height; ++y) {
         for (int x = 0; x < width; ++x) {
-          fprintf(blue_noise_image, "%d ",
-                  pbp[utility::twoToOne(x, y, width, height)] ? 1 : 0);
+          filter_out[torus.index(x, y)] = row_major_filter[x + y * width];
         }
-        fputc('\n', blue_noise_image);
       }
-      fclose(blue_noise_image);
+    }
+  };
+
+  recompute(pbp);
+#ifndef NDEBUG
+  internal::write_filter(to_row_major(), width, "filter_out_start.pgm");
 #endif
+
+  // filter_out is kept in sync with pbp (or pbp.reversed() if
+  // "filter_reversed") by only applying the gaussian of the toggled pixel,
+  // with a periodic full recompute to undo float drift. Fixed-point updates
+  // are exact and never recompute. "tree" follows both so every
+  // void/cluster lookup is O(1).
+  MinMaxTree tree(count);
+  tree.rebuild(filter_out, pbp, &pool);
+  bool filter_reversed = false;
+  int toggles_since_resync = 0;
+  const auto toggle = [&](int idx, bool value) {
+    pbp.set(idx, value);
+    if constexpr (!fixed_point) {
+      if (++toggles_since_resync >= internal::filter_resync_interval) {
+        recompute(PatternView(pbp, filter_reversed));
+        tree.rebuild(filter_out, pbp, &pool);
+        toggles_since_resync = 0;
+        assert(tree.minmax(pbp) ==
+               internal::filter_minmax(
+                   filter_out, PatternView(pbp, filter_reversed), &pool));
+        return;
+      }
     }
+    internal::update_filter(torus, filter_out, idx, taps,
+                            value != filter_reversed);
+    internal::for_each_filter_span(torus, idx, [&](int begin, int end) {
+      tree.update(filter_out, pbp, begin, end);
+    });
+  };
+
+  std::cout << "Begin BinaryArray generation loop\n";
+  int swaps = 0;
+  if (options.parallel_swaps) {
+    // The serial loop below finishes whatever the rounds leave, like swaps
+    // between tiles.
+    const int parallel_swaps = internal::parallel_remove_clusters(
+        torus, filter_out, taps, pbp, pool, count, [&](int round_swaps) {
+          toggles_since_resync += round_swaps * 2;
+          if (!fixed_point &&
+              toggles_since_resync >= internal::filter_resync_interval) {
+            recompute(pbp);
+            toggles_since_resync = 0;
+          }
+        });
+    tree.rebuild(filter_out, pbp, &pool);
+    std::cout << "Parallel rounds did " << parallel_swaps << " swaps\n";
+    swaps += parallel_swaps;
+  }
+  swaps += internal::remove_clusters(tree, pbp, toggle);
+  std::cout << "BinaryArray generation took " << swaps << " swaps";
+  if (coarse_swaps > 0) {
+    std::cout << " (and " << coarse_swaps << " on coarser levels)";
+  }
+  std::cout << '\n';
+  if constexpr (!fixed_point) {
+    recompute(pbp);
+    tree.rebuild(filter_out, pbp, &pool);
+    toggles_since_resync = 0;
   }
-  internal::compute_filter(pbp, width, height, count, filter_size, filter_out,
-                           precomputed.get(), threads);
 #ifndef NDEBUG
-  internal::write_filter(filter_out, width, "filter_out_final.pgm");
+  internal::write_filter(to_row_major(), width, "filter_out_final.pgm");
 #endif
 
 #ifndef NDEBUG
@@ -1526,8 +1878,7 @@ std::vector<unsigned int> dither::internal::blue_noise_impl(int width,
   fprintf(blue_noise_image, "P1\n%d %d\n", width, height);
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x) {
-      fprintf(blue_noise_image, "%d ",
-              pbp[utility::twoToOne(x, y, width, height)] ? 1 : 0);
+      fprintf(blue_noise_image, "%d ", pbp[torus.index(x, y)] ? 1 : 0);
     }
     fputc('\n', blue_noise_image);
   }
@@ -1537,284 +1888,905 @@ std::vector<unsigned int> dither::internal::blue_noise_impl(int width,
   std::cout << "Generating dither_array...\n";
   std::vector<unsigned int> dither_array(count);
   int min, max;
+
+  // Approximate ranking, see internal::RankBatchPicker. Picks only update
+  // the energies, "tree" is rebuilt when a phase starts.
+  const bool batched = options.rank_batch > 1;
+  internal::RankBatchPicker picker;
+  std::vector<int> picks;
+  int batch_steps = 0;
+  int out_of_order = 0;
+  // Ranks "remaining" pixels starting at "rank" and counting towards
+  // "direction", setting each to the inverse of "candidate_value".
+  const auto rank_batched = [&](int rank, int remaining, int direction,
+                                bool candidate_value, bool want_max) {
+    picker.invalidate_all();
+    while (remaining > 0) {
+      const int separation = internal::rank_batch_separation(
+          count, std::min(pbp.count(), count - pbp.count()), filter_size);
+      out_of_order += picker.pick(
+          torus, filter_out.data(), pbp, candidate_value, want_max, separation,
+          std::min(options.rank_batch, remaining), taps, &pool, picks);
+      ++batch_steps;
+      for (int idx : picks) {
+        pbp.set(idx, !candidate_value);
+        internal::update_filter(torus, filter_out, idx, taps,
+                                !candidate_value != filter_reversed);
+        dither_array[idx] = rank;
+        rank += direction;
+        --remaining;
+      }
+      if constexpr (!fixed_point) {
+        toggles_since_resync += picks.size();
+        if (toggles_since_resync >= internal::filter_resync_interval) {
+          recompute(PatternView(pbp, filter_reversed));
+          picker.invalidate_all();
+          toggles_since_resync = 0;
+        }
+      }
+    }
+  };
+
   {
-    std::vector<bool> pbp_copy(pbp);
+    Pattern pbp_copy(pbp);
+    std::vector<Energy> filter_copy(filter_out);
     std::cout << "Ranking minority pixels...\n";
-    for (unsigned int i = pixel_count; i-- > 0;) {
+    if (batched) {
+      rank_batched(pixel_count - 1, pixel_count, -1, true, true);
+    }
+    for (unsigned int i = batched ? 0 : pixel_count; i-- > 0;) {
 #ifndef NDEBUG
       std::cout << i << ' ';
 #endif
-      internal::compute_filter(pbp, width, height, count, filter_size,
-                               filter_out, precomputed.get(), threads);
-      std::tie(std::ignore, max) = internal::filter_minmax(filter_out, pbp);
-      pbp[max] = false;
+      std::tie(std::ignore, max) = tree.minmax(pbp);
+      toggle(max, false);
       dither_array[max] = i;
     }
     pbp = pbp_copy;
+    filter_out = filter_copy;
+    tree.rebuild(filter_out, pbp, &pool);
   }
   std::cout << "\nRanking remainder of first half of pixels...\n";
-  for (unsigned int i = pixel_count; i < (unsigned int)((count + 1) / 2); ++i) {
+  if (batched) {
+    rank_batched(pixel_count, (count + 1) / 2 - pixel_count, 1, false, false);
+  }
+  for (unsigned int i = batched ? (count + 1) / 2 : pixel_count;
+       i < (unsigned int)((count + 1) / 2); ++i) {
 #ifndef NDEBUG
     std::cout << i << ' ';
 #endif
-    internal::compute_filter(pbp, width, height, count, filter_size, filter_out,
-                             precomputed.get(), threads);
-    std::tie(min, std::ignore) = internal::filter_minmax(filter_out, pbp);
-    pbp[min] = true;
+    std::tie(min, std::ignore) = tree.minmax(pbp);
+    toggle(min, true);
     dither_array[min] = i;
   }
   std::cout << "\nRanking last half of pixels...\n";
-  std::vector<bool> reversed_pbp(pbp);
-  for (unsigned int i = (count + 1) / 2; i < (unsigned int)count; ++i) {
+  filter_reversed = true;
+  if (options.complement_energy) {
+    internal::complement_filter(filter_out.data(), count,
+                                internal::kernel_mass(taps));
+  } else {
+    recompute(pbp.reversed());
+    toggles_since_resync = 0;
+  }
+  if (batched) {
+    rank_batched((count + 1) / 2, count - (count + 1) / 2, 1, false, true);
+  } else {
+    tree.rebuild(filter_out, pbp, &pool);
+  }
+  for (unsigned int i = batched ? count : (count + 1) / 2;
+       i < (unsigned int)count; ++i) {
 #ifndef NDEBUG
     std::cout << i << ' ';
 #endif
-    for (unsigned int i = 0; i < pbp.size(); ++i) {
-      reversed_pbp[i] = !pbp[i];
-    }
-    internal::compute_filter(reversed_pbp, width, height, count, filter_size,
-                             filter_out, precomputed.get(), threads);
-    std::tie(std::ignore, max) = internal::filter_minmax(filter_out, pbp);
-    pbp[max] = true;
+    std::tie(std::ignore, max) = tree.minmax(pbp);
+    toggle(max, true);
     dither_array[max] = i;
   }
+  if (batched) {
+    internal::print_rank_batch_stats(count, batch_steps, out_of_order);
+  }
 
   return dither_array;
 }
 
-#if DITHERING_OPENCL_ENABLED == 1
-std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
-    const int width, const int height, const int filter_size,
-    cl_context context, cl_device_id device, cl_program program) {
-  cl_int err;
-  cl_kernel kernel;
-  cl_command_queue queue;
-  cl_mem d_filter_out, d_precomputed, d_pbp;
-  std::size_t global_size, local_size;
-
-  std::vector<float> precomputed = precompute_gaussian(filter_size);
+namespace {
+/// filter_size picked by get_filter_size() for the default kernel_tolerance,
+/// the only kernel the FixedTorus engines are instantiated for.
+constexpr int fixed_filter_size = 17;
 
-  int count = width * height;
-  int pixel_count = count * 4 / 10;
-  std::vector<bool> pbp = random_noise(count, pixel_count);
-  std::vector<int> pbp_i(pbp.size());
+template <int Size, typename Energy>
+bool try_fixed_engine(int width, int height, int filter_size, int threads,
+                      const dither::Options &options, image::Bl &result) {
+  if (width != Size || height != Size || filter_size != fixed_filter_size) {
+    return false;
+  }
+  std::cout << "Using the " << Size << "x" << Size
+            << " power of two engine\n";
+  const dither::internal::FixedTorus<Size, fixed_filter_size> torus;
+  result = dither::internal::rangeToBl(
+      dither::internal::blue_noise_engine<
+          dither::internal::FixedTorus<Size, fixed_filter_size>, Energy>(
+          torus, threads, options),
+      torus);
+  return true;
+}
 
-  queue = clCreateCommandQueueWithProperties(context, device, nullptr, &err);
+template <typename Energy>
+image::Bl dispatch_engine(int width, int height, int threads,
+                          const dither::Options &options) {
+  const int filter_size =
+      dither::internal::get_filter_size(width, height, options);
+
+  if (options.tiled_layout) {
+    if (dither::internal::TiledTorus::fits(width, height)) {
+      std::cout << "Using the " << dither::internal::TiledTorus::tile_size
+                << "x" << dither::internal::TiledTorus::tile_size
+                << " tiled layout\n";
+      const dither::internal::TiledTorus torus(width, height, filter_size);
+      return dither::internal::rangeToBl(
+          dither::internal::blue_noise_engine<dither::internal::TiledTorus,
+                                              Energy>(torus, threads, options),
+          torus);
+    }
+    std::clog << "WARNING: The tiled layout needs both sides to be a "
+                 "multiple of "
+              << dither::internal::TiledTorus::tile_size
+              << ", using rows instead\n";
+  }
 
-  d_filter_out = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-                                count * sizeof(float), nullptr, nullptr);
-  d_precomputed =
-      clCreateBuffer(context, CL_MEM_READ_ONLY,
-                     precomputed.size() * sizeof(float), nullptr, nullptr);
-  d_pbp = clCreateBuffer(context, CL_MEM_READ_ONLY, count * sizeof(int),
-                         nullptr, nullptr);
+  image::Bl result;
+  if (try_fixed_engine<64, Energy>(width, height, filter_size, threads,
+                                   options, result) ||
+      try_fixed_engine<128, Energy>(width, height, filter_size, threads,
+                                    options, result) ||
+      try_fixed_engine<256, Energy>(width, height, filter_size, threads,
+                                    options, result) ||
+      try_fixed_engine<512, Energy>(width, height, filter_size, threads,
+                                    options, result)) {
+    return result;
+  }
+  const dither::internal::Torus torus(width, height, filter_size);
+  return dither::internal::rangeToBl(
+      dither::internal::blue_noise_engine<dither::internal::Torus, Energy>(
+          torus, threads, options),
+      torus);
+}
+}  // namespace
 
-  err = clEnqueueWriteBuffer(queue, d_precomputed, CL_TRUE, 0,
-                             precomputed.size() * sizeof(float),
-                             &precomputed[0], 0, nullptr, nullptr);
-  if (err != CL_SUCCESS) {
-    std::cerr << "OpenCL: Failed to write to d_precomputed buffer\n";
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
-    return {};
+image::Bl dither::internal::blue_noise_impl(
+    int width, int height, int threads, const Options &options) {
+  if (options.fixed_point) {
+    return dispatch_engine<std::int32_t>(width, height, threads, options);
   }
+  return dispatch_engine<float>(width, height, threads, options);
+}
 
-  kernel = clCreateKernel(program, "do_filter", &err);
-  if (err != CL_SUCCESS) {
-    std::cerr << "OpenCL: Failed to create kernel: ";
-    switch (err) {
-      case CL_INVALID_PROGRAM:
-        std::cerr << "invalid program\n";
-        break;
-      case CL_INVALID_PROGRAM_EXECUTABLE:
-        std::cerr << "invalid program executable\n";
-        break;
-      case CL_INVALID_KERNEL_NAME:
-        std::cerr << "invalid kernel name\n";
-        break;
-      case CL_INVALID_KERNEL_DEFINITION:
-        std::cerr << "invalid kernel definition\n";
-        break;
-      case CL_INVALID_VALUE:
-        std::cerr << "invalid value\n";
-        break;
-      case CL_OUT_OF_RESOURCES:
-        std::cerr << "out of resources\n";
-        break;
-      case CL_OUT_OF_HOST_MEMORY:
-        std::cerr << "out of host memory\n";
-        break;
-      default:
-        std::cerr << "unknown error\n";
-        break;
-    }
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
-    return {};
+#if DITHERING_OPENCL_ENABLED == 1
+namespace {
+/// 64-bit FNV-1a, stable across runs unlike std::hash.
+std::uint64_t fnv1a(const std::string &data) {
+  std::uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : data) {
+    hash = (hash ^ c) * 0x100000001b3ULL;
   }
+  return hash;
+}
 
-  if (clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_filter_out) != CL_SUCCESS) {
-    std::cerr << "OpenCL: Failed to set kernel arg 0\n";
-    clReleaseKernel(kernel);
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
+std::string cl_device_string(cl_device_id device, cl_device_info info) {
+  std::size_t size = 0;
+  if (clGetDeviceInfo(device, info, 0, nullptr, &size) != CL_SUCCESS) {
     return {};
   }
-  if (clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_precomputed) != CL_SUCCESS) {
-    std::cerr << "OpenCL: Failed to set kernel arg 1\n";
-    clReleaseKernel(kernel);
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
+  std::string value(size, '\0');
+  if (clGetDeviceInfo(device, info, size, value.data(), nullptr) !=
+      CL_SUCCESS) {
     return {};
   }
-  if (clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_pbp) != CL_SUCCESS) {
-    std::cerr << "OpenCL: Failed to set kernel arg 2\n";
-    clReleaseKernel(kernel);
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
-    return {};
+  return value.c_str();
+}
+
+/// Directory of the program binary cache, empty if there is no home.
+std::filesystem::path cl_cache_directory() {
+  if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache && *cache) {
+    return std::filesystem::path(cache) / "blueNoiseGen";
+  } else if (const char *home = std::getenv("HOME"); home && *home) {
+    return std::filesystem::path(home) / ".cache" / "blueNoiseGen";
   }
-  if (clSetKernelArg(kernel, 3, sizeof(int), &width) != CL_SUCCESS) {
-    std::cerr << "OpenCL: Failed to set kernel arg 3\n";
-    clReleaseKernel(kernel);
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
+  return {};
+}
+
+bool build_cl_program_for(cl_program program, cl_device_id device) {
+  if (clBuildProgram(program, 1, &device, nullptr, nullptr, nullptr) ==
+      CL_SUCCESS) {
+    return true;
+  }
+  std::cerr << "OpenCL: Failed to build the program\n";
+
+  std::size_t log_size;
+  clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr,
+                        &log_size);
+  std::unique_ptr<char[]> log = std::make_unique<char[]>(log_size + 1);
+  log[log_size] = 0;
+  clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size,
+                        log.get(), nullptr);
+  std::cerr << log.get() << std::endl;
+  return false;
+}
+}  // namespace
+
+std::vector<cl_device_id> dither::internal::cl_list_devices() {
+  cl_uint platform_count = 0;
+  if (clGetPlatformIDs(0, nullptr, &platform_count) != CL_SUCCESS ||
+      platform_count == 0) {
+    std::cerr << "OpenCL: Failed to identify a platform\n";
     return {};
   }
-  if (clSetKernelArg(kernel, 4, sizeof(int), &height) != CL_SUCCESS) {
-    std::cerr << "OpenCL: Failed to set kernel arg 4\n";
-    clReleaseKernel(kernel);
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
+  std::vector<cl_platform_id> platforms(platform_count);
+  if (clGetPlatformIDs(platform_count, platforms.data(), nullptr) !=
+      CL_SUCCESS) {
+    std::cerr << "OpenCL: Failed to identify a platform\n";
     return {};
   }
-  if (filter_size % 2 == 0) {
-    int filter_size_odd = filter_size + 1;
-    if (clSetKernelArg(kernel, 5, sizeof(int), &filter_size_odd) !=
-        CL_SUCCESS) {
-      std::cerr << "OpenCL: Failed to set kernel arg 4\n";
-      clReleaseKernel(kernel);
-      clReleaseMemObject(d_pbp);
-      clReleaseMemObject(d_precomputed);
-      clReleaseMemObject(d_filter_out);
-      clReleaseCommandQueue(queue);
-      return {};
+
+  std::vector<cl_device_id> devices;
+  for (cl_platform_id platform : platforms) {
+    cl_uint device_count = 0;
+    // A platform without devices reports CL_DEVICE_NOT_FOUND.
+    if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, nullptr,
+                       &device_count) != CL_SUCCESS ||
+        device_count == 0) {
+      continue;
+    }
+    const std::size_t first = devices.size();
+    devices.resize(first + device_count);
+    if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, device_count,
+                       devices.data() + first, nullptr) != CL_SUCCESS) {
+      devices.resize(first);
     }
+  }
+
+  for (std::size_t i = 0; i < devices.size(); ++i) {
+    cl_device_type type = 0;
+    clGetDeviceInfo(devices[i], CL_DEVICE_TYPE, sizeof(type), &type, nullptr);
+    std::cout << "OpenCL: Device " << i << ": "
+              << cl_device_string(devices[i], CL_DEVICE_NAME) << " ("
+              << ((type & CL_DEVICE_TYPE_GPU)   ? "GPU"
+                  : (type & CL_DEVICE_TYPE_CPU) ? "CPU"
+                                                : "other")
+              << ", " << cl_device_string(devices[i], CL_DEVICE_VENDOR)
+              << ")\n";
+  }
+  return devices;
+}
+
+cl_program dither::internal::build_cl_program(cl_context context,
+                                              cl_device_id device) {
+  const std::string source = blue_noise_cl_source;
+  // Cache files start with the whole key and a null byte, a hash collision
+  // is then only a cache miss.
+  std::ostringstream key_stream;
+  key_stream << cl_device_string(device, CL_DEVICE_NAME) << '\n'
+             << cl_device_string(device, CL_DEVICE_VENDOR) << '\n'
+             << cl_device_string(device, CL_DEVICE_VERSION) << '\n'
+             << cl_device_string(device, CL_DRIVER_VERSION) << '\n'
+             << std::hex << fnv1a(source);
+  const std::string key = key_stream.str();
+  std::filesystem::path cache_path = cl_cache_directory();
+  if (!cache_path.empty()) {
+    std::ostringstream name;
+    name << "opencl_" << std::hex << fnv1a(key) << ".bin";
+    cache_path /= name.str();
+  }
+
+  cl_int err;
+  if (!cache_path.empty()) {
+    std::ifstream cache_file(cache_path, std::ios::binary);
+    const std::string cached((std::istreambuf_iterator<char>(cache_file)),
+                             std::istreambuf_iterator<char>());
+    if (cached.size() > key.size() + 1 &&
+        cached.compare(0, key.size(), key) == 0 && cached[key.size()] == 0) {
+      const unsigned char *binary =
+          (const unsigned char *)cached.data() + key.size() + 1;
+      const std::size_t binary_size = cached.size() - key.size() - 1;
+      cl_int binary_status;
+      cl_program program =
+          clCreateProgramWithBinary(context, 1, &device, &binary_size, &binary,
+                                    &binary_status, &err);
+      if (err == CL_SUCCESS && binary_status == CL_SUCCESS &&
+          build_cl_program_for(program, device)) {
+        std::cout << "OpenCL: Loaded the program binary from " << cache_path
+                  << std::endl;
+        return program;
+      }
+      if (err == CL_SUCCESS) {
+        clReleaseProgram(program);
+      }
+      std::clog << "WARNING: OpenCL: Ignoring the unusable program binary "
+                << cache_path << '\n';
+    }
+  }
+
+  const char *string_ptr = source.c_str();
+  std::size_t program_size = source.size();
+  cl_program program = clCreateProgramWithSource(context, 1, &string_ptr,
+                                                 &program_size, &err);
+  if (err != CL_SUCCESS) {
+    std::cerr << "OpenCL: Failed to create the program\n";
+    return nullptr;
+  }
+  if (!build_cl_program_for(program, device)) {
+    clReleaseProgram(program);
+    return nullptr;
+  }
+
+  std::size_t binary_size = 0;
+  if (cache_path.empty() ||
+      clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(std::size_t),
+                       &binary_size, nullptr) != CL_SUCCESS ||
+      binary_size == 0) {
+    return program;
+  }
+  std::string binary(binary_size, '\0');
+  unsigned char *binary_ptr = (unsigned char *)binary.data();
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary_ptr),
+                       &binary_ptr, nullptr) != CL_SUCCESS) {
+    return program;
+  }
+  // Written to a temporary file first, so a concurrent run never reads a
+  // partial binary.
+  std::error_code error;
+  std::filesystem::create_directories(cache_path.parent_path(), error);
+  std::filesystem::path temporary_path = cache_path;
+  temporary_path += ".tmp";
+  {
+    std::ofstream cache_file(temporary_path, std::ios::binary);
+    cache_file.write(key.data(), key.size());
+    cache_file.put('\0');
+    cache_file.write(binary.data(), binary.size());
+    if (!cache_file.good()) {
+      error = std::make_error_code(std::errc::io_error);
+    }
+  }
+  if (!error) {
+    std::filesystem::rename(temporary_path, cache_path, error);
+  }
+  if (error) {
+    std::filesystem::remove(temporary_path, error);
+    std::clog << "WARNING: OpenCL: Failed to cache the program binary in "
+              << cache_path << '\n';
   } else {
-    if (clSetKernelArg(kernel, 5, sizeof(int), &filter_size) != CL_SUCCESS) {
-      std::cerr << "OpenCL: Failed to set kernel arg 4\n";
+    std::cout << "OpenCL: Cached the program binary in " << cache_path
+              << std::endl;
+  }
+  return program;
+}
+
+namespace {
+const char *cl_error_string(cl_int err) {
+  switch (err) {
+    case CL_INVALID_PROGRAM:
+      return "invalid program";
+    case CL_INVALID_PROGRAM_EXECUTABLE:
+      return "invalid program executable";
+    case CL_INVALID_KERNEL_NAME:
+      return "invalid kernel name";
+    case CL_INVALID_KERNEL_DEFINITION:
+      return "invalid kernel definition";
+    case CL_INVALID_VALUE:
+      return "invalid value";
+    case CL_OUT_OF_RESOURCES:
+      return "out of resources";
+    case CL_OUT_OF_HOST_MEMORY:
+      return "out of host memory";
+    case CL_INVALID_COMMAND_QUEUE:
+      return "invalid command queue";
+    case CL_INVALID_KERNEL:
+      return "invalid kernel";
+    case CL_INVALID_CONTEXT:
+      return "invalid context";
+    case CL_INVALID_KERNEL_ARGS:
+      return "invalid kernel args";
+    case CL_INVALID_WORK_DIMENSION:
+      return "invalid work dimension";
+    case CL_INVALID_GLOBAL_WORK_SIZE:
+      return "invalid global work size";
+    case CL_INVALID_GLOBAL_OFFSET:
+      return "invalid global offset";
+    case CL_INVALID_WORK_GROUP_SIZE:
+      return "invalid work group size";
+    case CL_INVALID_WORK_ITEM_SIZE:
+      return "invalid work item size";
+    case CL_MISALIGNED_SUB_BUFFER_OFFSET:
+      return "misaligned sub buffer offset";
+    default:
+      return "unknown error";
+  }
+}
+
+/// One device of blue_noise_cl_impl(), computing the energies of the
+/// "row_count" rows from "first_row" on. Every device keeps the whole pattern
+/// in "d_pbp" and applies every change to it.
+struct ClSlice {
+  ClSlice(cl_device_id device, int first_row, int row_count);
+  ~ClSlice();
+
+  // deny copy, the handles are released once
+  ClSlice(const ClSlice &) = delete;
+  ClSlice &operator=(const ClSlice &) = delete;
+
+  /// Creates the queue, buffers and kernels. Prints what failed and returns
+  /// false on failure, the destructor releases whatever was created.
+  bool setup(cl_context context, cl_program program, int width, int height,
+             int filter_size, const std::vector<float> &quadrant,
+             std::size_t change_capacity);
+
+  cl_device_id device;
+  int first_row;
+  int row_count;
+  cl_command_queue queue;
+  cl_mem d_filter_out;
+  cl_mem d_precomputed;
+  cl_mem d_pbp;
+  cl_mem d_changes;
+  // Device state at the start of the minority ranking, restored after it.
+  cl_mem d_filter_saved;
+  cl_mem d_pbp_saved;
+  cl_mem d_partial_values;
+  cl_mem d_partial_indices;
+  cl_mem d_minmax_values;
+  cl_mem d_minmax_indices;
+  cl_kernel filter_kernel;
+  cl_kernel update_kernel;
+  cl_kernel splat_kernel;
+  cl_kernel partial_kernel;
+  cl_kernel final_kernel;
+  std::size_t global_size;
+  std::size_t local_size;
+  std::size_t splat_size;
+  std::size_t reduce_local_size;
+  std::size_t reduce_global_size;
+  int reduce_groups;
+  // The four pairs of the last min/max reduction, see minmax_partial.
+  float minmax_values[4];
+  int minmax_indices[4];
+};
+
+ClSlice::ClSlice(cl_device_id device, int first_row, int row_count)
+    : device(device),
+      first_row(first_row),
+      row_count(row_count),
+      queue(nullptr),
+      d_filter_out(nullptr),
+      d_precomputed(nullptr),
+      d_pbp(nullptr),
+      d_changes(nullptr),
+      d_filter_saved(nullptr),
+      d_pbp_saved(nullptr),
+      d_partial_values(nullptr),
+      d_partial_indices(nullptr),
+      d_minmax_values(nullptr),
+      d_minmax_indices(nullptr),
+      filter_kernel(nullptr),
+      update_kernel(nullptr),
+      splat_kernel(nullptr),
+      partial_kernel(nullptr),
+      final_kernel(nullptr),
+      global_size(0),
+      local_size(0),
+      splat_size(0),
+      reduce_local_size(1),
+      reduce_global_size(0),
+      reduce_groups(0),
+      minmax_values(),
+      minmax_indices() {}
+
+ClSlice::~ClSlice() {
+  if (queue) {
+    // Writes still queued read host memory.
+    clFinish(queue);
+  }
+  for (cl_kernel kernel : {final_kernel, partial_kernel, splat_kernel,
+                           update_kernel, filter_kernel}) {
+    if (kernel) {
       clReleaseKernel(kernel);
-      clReleaseMemObject(d_pbp);
-      clReleaseMemObject(d_precomputed);
-      clReleaseMemObject(d_filter_out);
-      clReleaseCommandQueue(queue);
-      return {};
+    }
+  }
+  for (cl_mem buffer :
+       {d_minmax_indices, d_minmax_values, d_partial_indices, d_partial_values,
+        d_pbp_saved, d_filter_saved, d_changes, d_pbp, d_precomputed,
+        d_filter_out}) {
+    if (buffer) {
+      clReleaseMemObject(buffer);
+    }
+  }
+  if (queue) {
+    clReleaseCommandQueue(queue);
+  }
+}
+
+bool ClSlice::setup(cl_context context, cl_program program, int width,
+                    int height, int filter_size,
+                    const std::vector<float> &quadrant,
+                    std::size_t change_capacity) {
+  cl_int err;
+  const int count = width * height;
+  const int first = first_row * width;
+  const int slice_count = row_count * width;
+
+  queue = clCreateCommandQueueWithProperties(context, device, nullptr, &err);
+  if (err != CL_SUCCESS) {
+    std::cerr << "OpenCL: Failed to create a command queue\n";
+    queue = nullptr;
+    return false;
+  }
+
+  d_filter_out = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                slice_count * sizeof(float), nullptr, nullptr);
+  d_precomputed =
+      clCreateBuffer(context, CL_MEM_READ_ONLY,
+                     quadrant.size() * sizeof(float), nullptr, nullptr);
+  d_pbp = clCreateBuffer(context, CL_MEM_READ_WRITE, count * sizeof(int),
+                         nullptr, nullptr);
+  d_changes = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                             change_capacity * sizeof(int), nullptr, nullptr);
+  d_filter_saved = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                  slice_count * sizeof(float), nullptr,
+                                  nullptr);
+  d_pbp_saved = clCreateBuffer(context, CL_MEM_READ_WRITE, count * sizeof(int),
+                               nullptr, nullptr);
+  if (!d_filter_out || !d_precomputed || !d_pbp || !d_changes ||
+      !d_filter_saved || !d_pbp_saved) {
+    std::cerr << "OpenCL: Failed to create buffers\n";
+    return false;
+  }
+
+  err = clEnqueueWriteBuffer(queue, d_precomputed, CL_TRUE, 0,
+                             quadrant.size() * sizeof(float), &quadrant[0], 0,
+                             nullptr, nullptr);
+  if (err != CL_SUCCESS) {
+    std::cerr << "OpenCL: Failed to write to d_precomputed buffer\n";
+    return false;
+  }
+
+  for (auto [kernel, name] :
+       {std::pair{&filter_kernel, "do_filter"},
+        std::pair{&update_kernel, "update_pbp"},
+        std::pair{&splat_kernel, "splat"},
+        std::pair{&partial_kernel, "minmax_partial"},
+        std::pair{&final_kernel, "minmax_final"}}) {
+    *kernel = clCreateKernel(program, name, &err);
+    if (err != CL_SUCCESS) {
+      std::cerr << "OpenCL: Failed to create kernel " << name << ": "
+                << cl_error_string(err) << '\n';
+      *kernel = nullptr;
+      return false;
     }
   }
 
-  if (clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
-                               sizeof(std::size_t), &local_size,
+  std::size_t partial_max = 0;
+  std::size_t final_max = 0;
+  if (clGetKernelWorkGroupInfo(filter_kernel, device,
+                               CL_KERNEL_WORK_GROUP_SIZE, sizeof(std::size_t),
+                               &local_size, nullptr) != CL_SUCCESS ||
+      clGetKernelWorkGroupInfo(partial_kernel, device,
+                               CL_KERNEL_WORK_GROUP_SIZE, sizeof(std::size_t),
+                               &partial_max, nullptr) != CL_SUCCESS ||
+      clGetKernelWorkGroupInfo(final_kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                               sizeof(std::size_t), &final_max,
                                nullptr) != CL_SUCCESS) {
     std::cerr << "OpenCL: Failed to get work group size\n";
-    clReleaseKernel(kernel);
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
-    return {};
+    return false;
+  }
+  global_size = (slice_count + local_size - 1) / local_size * local_size;
+  splat_size =
+      std::min(filter_size, width) * std::min(filter_size, height);
+
+  // The min/max lookups reduce d_filter_out on the device, in up to 64 work
+  // groups of a power of two work items and then in one more group, and only
+  // read back the four pairs.
+  while (reduce_local_size * 2 <=
+         std::min({partial_max, final_max, (std::size_t)256})) {
+    reduce_local_size *= 2;
+  }
+  reduce_groups = std::min<int>(
+      64, (slice_count + reduce_local_size - 1) / reduce_local_size);
+  reduce_global_size = reduce_groups * reduce_local_size;
+  const std::size_t reduce_local_bytes = 4 * reduce_local_size;
+  d_partial_values =
+      clCreateBuffer(context, CL_MEM_READ_WRITE,
+                     reduce_groups * 4 * sizeof(float), nullptr, nullptr);
+  d_partial_indices =
+      clCreateBuffer(context, CL_MEM_READ_WRITE,
+                     reduce_groups * 4 * sizeof(int), nullptr, nullptr);
+  d_minmax_values = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                                   4 * sizeof(float), nullptr, nullptr);
+  d_minmax_indices = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                                    4 * sizeof(int), nullptr, nullptr);
+  if (!d_partial_values || !d_partial_indices || !d_minmax_values ||
+      !d_minmax_indices) {
+    std::cerr << "OpenCL: Failed to create buffers\n";
+    return false;
+  }
+
+  // Sets the arguments of "kernel" from the first on, the change index of
+  // update_pbp and splat is set before each launch.
+  const auto set_args = [](cl_kernel kernel, auto... args) {
+    cl_uint index = 0;
+    return ((clSetKernelArg(kernel, index++, sizeof(args), &args) ==
+             CL_SUCCESS) &&
+            ...);
+  };
+  if (!set_args(filter_kernel, d_filter_out, d_precomputed, d_pbp, width,
+                height, filter_size, first_row, row_count) ||
+      !set_args(update_kernel, d_pbp, d_changes, 0) ||
+      !set_args(splat_kernel, d_filter_out, d_precomputed, d_changes, 0,
+                width, height, filter_size, first_row, row_count) ||
+      !set_args(partial_kernel, d_filter_out, d_pbp, first, slice_count,
+                d_partial_values, d_partial_indices) ||
+      clSetKernelArg(partial_kernel, 6, reduce_local_bytes * sizeof(float),
+                     nullptr) != CL_SUCCESS ||
+      clSetKernelArg(partial_kernel, 7, reduce_local_bytes * sizeof(int),
+                     nullptr) != CL_SUCCESS ||
+      !set_args(final_kernel, d_partial_values, d_partial_indices,
+                reduce_groups, d_minmax_values, d_minmax_indices) ||
+      clSetKernelArg(final_kernel, 5, reduce_local_bytes * sizeof(float),
+                     nullptr) != CL_SUCCESS ||
+      clSetKernelArg(final_kernel, 6, reduce_local_bytes * sizeof(int),
+                     nullptr) != CL_SUCCESS) {
+    std::cerr << "OpenCL: Failed to set kernel args\n";
+    return false;
   }
-  global_size = (std::size_t)std::ceil(count / (float)local_size) * local_size;
 
-  std::cout << "OpenCL: global = " << global_size << ", local = " << local_size
+  std::cout << "OpenCL: Rows " << first_row << " to "
+            << first_row + row_count - 1 << ": global = " << global_size
+            << ", local = " << local_size << ", minmax reduction in "
+            << reduce_groups << " groups of " << reduce_local_size
             << std::endl;
+  return true;
+}
+}  // namespace
 
+std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
+    const int width, const int height, const int filter_size,
+    const std::vector<ClDevice> &devices, const Options &options) {
+  std::vector<float> precomputed = precompute_gaussian(filter_size);
+  // do_filter and splat read the folded quadrant of the kernel.
+  const std::vector<float> quadrant = fold_kernel(precomputed, filter_size);
+  const int filter_size_odd = filter_size % 2 == 0 ? filter_size + 1
+                                                   : filter_size;
+
+  int count = width * height;
+  int pixel_count = count * 4 / 10;
+  std::vector<bool> pbp = random_noise(count, pixel_count);
+  std::vector<int> pbp_i(pbp.size());
+  // d_pbp and d_filter_out stay on the devices. Pixels changed since the last
+  // filter are scattered into d_pbp by update_pbp and their kernels are added
+  // to d_filter_out by splat. More changes than fit "d_changes", a flip of
+  // "reversed_pbp" or filter_resync_interval incremental updates upload the
+  // whole pattern and run do_filter instead.
+  const std::size_t change_capacity =
+      std::max<std::size_t>(64, options.rank_batch);
+  // Index times two plus the new value of each pixel set since the last
+  // upload, in order.
+  std::vector<int> changed_pixels;
+  std::vector<int> changes;
+  bool pbp_uploaded = false;
+  int toggles_since_resync = 0;
+
+  // Device "d" of "n" computes the energies of rows d * height / n up to
+  // (d + 1) * height / n, each step runs on all of them before the host
+  // merges their min/max.
+  std::vector<std::unique_ptr<ClSlice>> slices;
+  for (std::size_t d = 0; d < devices.size(); ++d) {
+    const int first_row = d * height / devices.size();
+    const int end_row = (d + 1) * height / devices.size();
+    slices.push_back(std::make_unique<ClSlice>(devices[d].device, first_row,
+                                               end_row - first_row));
+    if (!slices.back()->setup(devices[d].context, devices[d].program, width,
+                              height, filter_size_odd, quadrant,
+                              change_capacity)) {
+      return {};
+    }
+  }
+
+  // Host copy of the energies, only read back by read_filter() for the
+  // approximate ranking and the debug images.
   std::vector<float> filter(count);
+  // Any failure of a device stops the ranking and returns no result.
+  bool failed = false;
 
   bool reversed_pbp = false;
 
-  const auto get_filter = [&queue, &kernel, &global_size, &local_size,
-                           &d_filter_out, &d_pbp, &pbp, &pbp_i, &count, &filter,
-                           &err, &reversed_pbp]() -> bool {
-    for (unsigned int i = 0; i < pbp.size(); ++i) {
-      if (reversed_pbp) {
-        pbp_i[i] = pbp[i] ? 0 : 1;
-      } else {
-        pbp_i[i] = pbp[i] ? 1 : 0;
+  // Number of set pixels in "pbp", to find its minority.
+  int set_count = std::count(pbp.begin(), pbp.end(), true);
+
+  // Toggles a pixel of "pbp" and queues it for the next upload.
+  const auto set_pixel = [&pbp, &changed_pixels, &set_count](int idx,
+                                                            bool value) {
+    assert(pbp.at(idx) != value);
+    set_count += value ? 1 : -1;
+    pbp.at(idx) = value;
+    changed_pixels.push_back(idx * 2 + (value ? 1 : 0));
+  };
+
+  // Brings d_pbp up to date, along with d_filter_out unless
+  // "needs_full_filter" is set.
+  bool needs_full_filter = true;
+  const auto upload_pbp = [&]() -> bool {
+    if (!pbp_uploaded || changed_pixels.size() > change_capacity ||
+        toggles_since_resync + changed_pixels.size() >=
+            (std::size_t)internal::filter_resync_interval) {
+      for (unsigned int i = 0; i < pbp.size(); ++i) {
+        if (reversed_pbp) {
+          pbp_i[i] = pbp[i] ? 0 : 1;
+        } else {
+          pbp_i[i] = pbp[i] ? 1 : 0;
+        }
       }
+      for (const auto &slice : slices) {
+        if (clEnqueueWriteBuffer(slice->queue, slice->d_pbp, CL_TRUE, 0,
+                                 count * sizeof(int), &pbp_i[0], 0, nullptr,
+                                 nullptr) != CL_SUCCESS) {
+          std::cerr << "OpenCL: Failed to write to d_pbp buffer\n";
+          return false;
+        }
+      }
+      pbp_uploaded = true;
+      needs_full_filter = true;
+      changed_pixels.clear();
+      return true;
     }
-    if (clEnqueueWriteBuffer(queue, d_pbp, CL_TRUE, 0, count * sizeof(int),
-                             &pbp_i[0], 0, nullptr, nullptr) != CL_SUCCESS) {
-      std::cerr << "OpenCL: Failed to write to d_pbp buffer\n";
-      return false;
+    if (changed_pixels.empty()) {
+      return true;
     }
 
-    if (err = clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &global_size,
-                                     &local_size, 0, nullptr, nullptr);
-        err != CL_SUCCESS) {
-      std::cerr << "OpenCL: Failed to enqueue task: ";
-      switch (err) {
-        case CL_INVALID_PROGRAM_EXECUTABLE:
-          std::cerr << "invalid program executable\n";
-          break;
-        case CL_INVALID_COMMAND_QUEUE:
-          std::cerr << "invalid command queue\n";
-          break;
-        case CL_INVALID_KERNEL:
-          std::cerr << "invalid kernel\n";
-          break;
-        case CL_INVALID_CONTEXT:
-          std::cerr << "invalid context\n";
-          break;
-        case CL_INVALID_KERNEL_ARGS:
-          std::cerr << "invalid kernel args\n";
-          break;
-        case CL_INVALID_WORK_DIMENSION:
-          std::cerr << "invalid work dimension\n";
-          break;
-        case CL_INVALID_GLOBAL_WORK_SIZE:
-          std::cerr << "invalid global work size\n";
-          break;
-        case CL_INVALID_GLOBAL_OFFSET:
-          std::cerr << "invalid global offset\n";
-          break;
-        case CL_INVALID_WORK_GROUP_SIZE:
-          std::cerr << "invalid work group size\n";
-          break;
-        case CL_INVALID_WORK_ITEM_SIZE:
-          std::cerr << "invalid work item size\n";
-          break;
-        case CL_MISALIGNED_SUB_BUFFER_OFFSET:
-          std::cerr << "misaligned sub buffer offset\n";
-          break;
-        default:
-          std::cerr << "Unknown\n";
-          break;
+    changes.clear();
+    for (int change : changed_pixels) {
+      changes.push_back((change & ~1) |
+                        ((change & 1) != (reversed_pbp ? 1 : 0) ? 1 : 0));
+    }
+    changed_pixels.clear();
+    // Not blocking, "changes" is only touched again after device_minmax() or
+    // read_filter() read back their results, which waits for this write.
+    const int change_count = changes.size();
+    std::size_t update_size = change_count;
+    for (const auto &slice : slices) {
+      if (clEnqueueWriteBuffer(slice->queue, slice->d_changes, CL_FALSE, 0,
+                               change_count * sizeof(int), changes.data(), 0,
+                               nullptr, nullptr) != CL_SUCCESS ||
+          clSetKernelArg(slice->update_kernel, 2, sizeof(int),
+                         &change_count) != CL_SUCCESS ||
+          clEnqueueNDRangeKernel(slice->queue, slice->update_kernel, 1,
+                                 nullptr, &update_size, nullptr, 0, nullptr,
+                                 nullptr) != CL_SUCCESS) {
+        std::cerr << "OpenCL: Failed to update d_pbp buffer\n";
+        return false;
+      }
+      // One change at a time, the windows of two changes may overlap.
+      for (int change = 0; change < change_count; ++change) {
+        if (clSetKernelArg(slice->splat_kernel, 3, sizeof(int), &change) !=
+                CL_SUCCESS ||
+            clEnqueueNDRangeKernel(slice->queue, slice->splat_kernel, 1,
+                                   nullptr, &slice->splat_size, nullptr, 0,
+                                   nullptr, nullptr) != CL_SUCCESS) {
+          std::cerr << "OpenCL: Failed to enqueue splat\n";
+          return false;
+        }
       }
-      return false;
     }
+    toggles_since_resync += change_count;
+    return true;
+  };
 
-    clFinish(queue);
+  // Brings d_filter_out up to date with the current pattern, with splats of
+  // the changed pixels or with a full do_filter.
+  const auto run_filter = [&]() -> bool {
+    if (!upload_pbp()) {
+      return false;
+    }
+    if (!needs_full_filter) {
+      return true;
+    }
 
-    clEnqueueReadBuffer(queue, d_filter_out, CL_TRUE, 0, count * sizeof(float),
-                        &filter[0], 0, nullptr, nullptr);
+    for (const auto &slice : slices) {
+      if (cl_int err = clEnqueueNDRangeKernel(
+              slice->queue, slice->filter_kernel, 1, nullptr,
+              &slice->global_size, &slice->local_size, 0, nullptr, nullptr);
+          err != CL_SUCCESS) {
+        std::cerr << "OpenCL: Failed to enqueue task: "
+                  << cl_error_string(err) << '\n';
+        return false;
+      }
+    }
+    needs_full_filter = false;
+    toggles_since_resync = 0;
 
     return true;
   };
 
+  // Waits for every device. Reads are enqueued without blocking on all of
+  // them first, so the devices work side by side.
+  const auto finish_all = [&]() {
+    for (const auto &slice : slices) {
+      if (clFinish(slice->queue) != CL_SUCCESS) {
+        failed = true;
+      }
+    }
+  };
+
+  const auto read_filter = [&]() {
+    for (const auto &slice : slices) {
+      if (clEnqueueReadBuffer(slice->queue, slice->d_filter_out, CL_FALSE, 0,
+                              slice->row_count * width * sizeof(float),
+                              &filter[slice->first_row * width], 0, nullptr,
+                              nullptr) != CL_SUCCESS ||
+          clFlush(slice->queue) != CL_SUCCESS) {
+        std::cerr << "OpenCL: Failed to read d_filter_out buffer\n";
+        failed = true;
+      }
+    }
+    finish_all();
+  };
+
+  // filter_minmax() of the energies, or of their complement to "mass" if
+  // "complement", over the host pattern. Returns {-1, -1} on failure.
+  const auto device_minmax = [&](bool complement) -> std::pair<int, int> {
+    for (const auto &slice : slices) {
+      if (clEnqueueNDRangeKernel(slice->queue, slice->partial_kernel, 1,
+                                 nullptr, &slice->reduce_global_size,
+                                 &slice->reduce_local_size, 0, nullptr,
+                                 nullptr) != CL_SUCCESS ||
+          clEnqueueNDRangeKernel(slice->queue, slice->final_kernel, 1, nullptr,
+                                 &slice->reduce_local_size,
+                                 &slice->reduce_local_size, 0, nullptr,
+                                 nullptr) != CL_SUCCESS ||
+          // The values are only needed to merge several devices.
+          (slices.size() > 1 &&
+           clEnqueueReadBuffer(slice->queue, slice->d_minmax_values, CL_FALSE,
+                               0, sizeof(slice->minmax_values),
+                               slice->minmax_values, 0, nullptr,
+                               nullptr) != CL_SUCCESS) ||
+          clEnqueueReadBuffer(slice->queue, slice->d_minmax_indices, CL_FALSE,
+                              0, sizeof(slice->minmax_indices),
+                              slice->minmax_indices, 0, nullptr,
+                              nullptr) != CL_SUCCESS ||
+          clFlush(slice->queue) != CL_SUCCESS) {
+        failed = true;
+        break;
+      }
+    }
+    finish_all();
+    if (failed) {
+      std::cerr << "OpenCL: Failed to reduce d_filter_out buffer\n";
+      return {-1, -1};
+    }
+
+    // Same order as minmax_better() in blue_noise.cl.
+    float values[4] = {0.0F, 0.0F, 0.0F, 0.0F};
+    int indices[4] = {-1, -1, -1, -1};
+    for (const auto &slice : slices) {
+      for (int c = 0; c < 4; ++c) {
+        const float value = slice->minmax_values[c];
+        const int index = slice->minmax_indices[c];
+        if (index >= 0 &&
+            (indices[c] < 0 ||
+             (value != values[c]
+                  ? (c % 2 == 1 ? value > values[c] : value < values[c])
+                  : index < indices[c]))) {
+          values[c] = value;
+          indices[c] = index;
+        }
+      }
+    }
+    // The devices see "pbp" flipped if "reversed_pbp". The complement's min
+    // is the energy's max and the other way around.
+    const bool minority = set_count * 2 < count;
+    const int minority_class = (minority != reversed_pbp ? 2 : 0);
+    const int other_class = 2 - minority_class;
+    return {indices[other_class + (complement ? 1 : 0)],
+            indices[minority_class + (complement ? 0 : 1)]};
+  };
+
   {
 #ifndef NDEBUG
     printf("Inserting %d pixels into image of max count %d\n", pixel_count,
@@ -1833,16 +2805,12 @@ std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
 #endif
   }
 
-  if (!get_filter()) {
+  if (!run_filter()) {
     std::cerr << "OpenCL: Failed to execute do_filter (at start)\n";
-    clReleaseKernel(kernel);
-    clReleaseMemObject(d_pbp);
-    clReleaseMemObject(d_precomputed);
-    clReleaseMemObject(d_filter_out);
-    clReleaseCommandQueue(queue);
     return {};
   } else {
 #ifndef NDEBUG
+    read_filter();
     internal::write_filter(filter, width, "filter_out_start.pgm");
 #endif
   }
@@ -1855,30 +2823,36 @@ std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
     printf("Iteration %d\n", ++iterations);
 #endif
 
-    if (!get_filter()) {
+    if (!run_filter()) {
       std::cerr << "OpenCL: Failed to execute do_filter\n";
       break;
     }
 
     int min, max;
-    std::tie(min, max) = internal::filter_minmax(filter, pbp);
+    std::tie(min, max) = device_minmax(false);
+    if (failed) {
+      break;
+    }
 
-    pbp[max] = false;
+    set_pixel(max, false);
 
-    if (!get_filter()) {
+    if (!run_filter()) {
       std::cerr << "OpenCL: Failed to execute do_filter\n";
       break;
     }
 
     // get second buffer's min
     int second_min;
-    std::tie(second_min, std::ignore) = internal::filter_minmax(filter, pbp);
+    std::tie(second_min, std::ignore) = device_minmax(false);
+    if (failed) {
+      break;
+    }
 
     if (second_min == max) {
-      pbp[max] = true;
+      set_pixel(max, true);
       break;
     } else {
-      pbp[second_min] = true;
+      set_pixel(second_min, true);
     }
 
     if (iterations % 100 == 0) {
@@ -1900,10 +2874,11 @@ std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
     }
   }
 
-  if (!get_filter()) {
+  if (!run_filter()) {
     std::cerr << "OpenCL: Failed to execute do_filter (at end)\n";
   } else {
 #ifndef NDEBUG
+    read_filter();
     internal::write_filter(filter, width, "filter_out_final.pgm");
     FILE *blue_noise_image = fopen("blue_noise.pbm", "w");
     fprintf(blue_noise_image, "P1\n%d %d\n", width, height);
@@ -1931,16 +2906,88 @@ std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
 #endif
   std::vector<unsigned int> dither_array(count, 0);
   int min, max;
+
+  // Approximate ranking, see internal::RankBatchPicker. Each step filters
+  // and reads back the whole field once for all of its picks.
+  const bool batched = options.rank_batch > 1;
+  const internal::Torus torus(width, height, filter_size);
+  internal::RankBatchPicker picker;
+  std::vector<int> picks;
+  int batch_steps = 0;
+  int out_of_order = 0;
+  // Ranks "remaining" pixels starting at "rank" and counting towards
+  // "direction", setting each to the inverse of "candidate_value".
+  const auto rank_batched = [&](int rank, int remaining, int direction,
+                                bool candidate_value, bool want_max,
+                                float complement_mass) {
+    picker.invalidate_all();
+    while (remaining > 0 && !failed) {
+      if (!run_filter()) {
+        failed = true;
+        break;
+      }
+      read_filter();
+      if (complement_mass > 0.0F) {
+        internal::complement_filter(filter.data(), count, complement_mass);
+      }
+      out_of_order += picker.pick(
+          torus, filter.data(), pbp, candidate_value, want_max,
+          internal::rank_batch_separation(
+              count, std::min(set_count, count - set_count),
+              torus.filter_size()),
+          std::min(options.rank_batch, remaining), precomputed, nullptr,
+          picks);
+      ++batch_steps;
+      for (int idx : picks) {
+        set_pixel(idx, !candidate_value);
+        dither_array.at(idx) = rank;
+        rank += direction;
+        --remaining;
+      }
+    }
+  };
+
   {
     std::vector<bool> pbp_copy(pbp);
+    // The device copies of the pattern and the energies are restored along
+    // with "pbp" afterwards.
+    failed = !run_filter();
+    const int saved_toggles = toggles_since_resync;
+    // Copies d_pbp and d_filter_out of every device to their saved copies,
+    // or back.
+    const auto copy_state = [&](bool restore) {
+      for (const auto &slice : slices) {
+        const std::size_t slice_bytes =
+            slice->row_count * width * sizeof(float);
+        if (clEnqueueCopyBuffer(
+                slice->queue, restore ? slice->d_pbp_saved : slice->d_pbp,
+                restore ? slice->d_pbp : slice->d_pbp_saved, 0, 0,
+                count * sizeof(int), 0, nullptr, nullptr) != CL_SUCCESS ||
+            clEnqueueCopyBuffer(
+                slice->queue,
+                restore ? slice->d_filter_saved : slice->d_filter_out,
+                restore ? slice->d_filter_out : slice->d_filter_saved, 0, 0,
+                slice_bytes, 0, nullptr, nullptr) != CL_SUCCESS) {
+          return false;
+        }
+      }
+      return true;
+    };
+    const bool saved = !failed && copy_state(false);
     std::cout << "Ranking minority pixels...\n";
-    for (unsigned int i = pixel_count; i-- > 0;) {
+    if (batched) {
+      rank_batched(pixel_count - 1, pixel_count, -1, true, true, 0.0F);
+    }
+    for (unsigned int i = batched ? 0 : pixel_count; i-- > 0 && !failed;) {
 #ifndef NDEBUG
       std::cout << i << ' ';
 #endif
-      get_filter();
-      std::tie(std::ignore, max) = internal::filter_minmax(filter, pbp);
-      pbp.at(max) = false;
+      failed = !run_filter();
+      std::tie(std::ignore, max) = device_minmax(false);
+      if (failed) {
+        break;
+      }
+      set_pixel(max, false);
       dither_array.at(max) = i;
 #ifndef NDEBUG
       if (set.find(max) != set.end()) {
@@ -1951,19 +2998,34 @@ std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
 #endif
     }
     pbp = pbp_copy;
+    set_count = std::count(pbp.begin(), pbp.end(), true);
+    changed_pixels.clear();
+    if (saved && copy_state(true)) {
+      toggles_since_resync = saved_toggles;
+    } else {
+      pbp_uploaded = false;
+    }
 #ifndef NDEBUG
     image::Bl min_pixels = internal::rangeToBl(dither_array, width);
     min_pixels.writeToFile(image::file_type::PNG, true, "da_min_pixels.png");
 #endif
   }
   std::cout << "\nRanking remainder of first half of pixels...\n";
-  for (unsigned int i = pixel_count; i < (unsigned int)((count + 1) / 2); ++i) {
+  if (batched) {
+    rank_batched(pixel_count, (count + 1) / 2 - pixel_count, 1, false, false,
+                 0.0F);
+  }
+  for (unsigned int i = batched ? (count + 1) / 2 : pixel_count;
+       i < (unsigned int)((count + 1) / 2) && !failed; ++i) {
 #ifndef NDEBUG
     std::cout << i << ' ';
 #endif
-    get_filter();
-    std::tie(min, std::ignore) = internal::filter_minmax(filter, pbp);
-    pbp.at(min) = true;
+    failed = !run_filter();
+    std::tie(min, std::ignore) = device_minmax(false);
+    if (failed) {
+      break;
+    }
+    set_pixel(min, true);
     dither_array.at(min) = i;
 #ifndef NDEBUG
     if (set.find(min) != set.end()) {
@@ -1977,21 +3039,33 @@ std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
   {
     image::Bl min_pixels = internal::rangeToBl(dither_array, width);
     min_pixels.writeToFile(image::file_type::PNG, true, "da_mid_pixels.png");
-    get_filter();
+    run_filter();
+    read_filter();
     internal::write_filter(filter, width, "filter_mid.pgm");
     image::Bl pbp_image = toBl(pbp, width);
     pbp_image.writeToFile(image::file_type::PNG, true, "debug_pbp_mid.png");
   }
 #endif
   std::cout << "\nRanking last half of pixels...\n";
-  reversed_pbp = true;
-  for (unsigned int i = (count + 1) / 2; i < (unsigned int)count; ++i) {
+  const float mass = internal::kernel_mass(precomputed);
+  reversed_pbp = !options.complement_energy;
+  pbp_uploaded = pbp_uploaded && !reversed_pbp;
+  if (batched) {
+    rank_batched((count + 1) / 2, count - (count + 1) / 2, 1, false, true,
+                 options.complement_energy ? mass : 0.0F);
+    internal::print_rank_batch_stats(count, batch_steps, out_of_order);
+  }
+  for (unsigned int i = batched ? count : (count + 1) / 2;
+       i < (unsigned int)count && !failed; ++i) {
 #ifndef NDEBUG
     std::cout << i << ' ';
 #endif
-    get_filter();
-    std::tie(std::ignore, max) = internal::filter_minmax(filter, pbp);
-    pbp.at(max) = true;
+    failed = !run_filter();
+    std::tie(std::ignore, max) = device_minmax(options.complement_energy);
+    if (failed) {
+      break;
+    }
+    set_pixel(max, true);
     dither_array.at(max) = i;
 #ifndef NDEBUG
     if (set.find(max) != set.end()) {
@@ -2004,19 +3078,22 @@ std::vector<unsigned int> dither::internal::blue_noise_cl_impl(
   std::cout << std::endl;
 
 #ifndef NDEBUG
-  {
-    get_filter();
+  if (!failed) {
+    run_filter();
+    read_filter();
+    if (options.complement_energy) {
+      internal::complement_filter(filter.data(), count, mass);
+    }
     internal::write_filter(filter, width, "filter_after.pgm");
     image::Bl pbp_image = toBl(pbp, width);
     pbp_image.writeToFile(image::file_type::PNG, true, "debug_pbp_after.png");
   }
 #endif
 
-  clReleaseKernel(kernel);
-  clReleaseMemObject(d_pbp);
-  clReleaseMemObject(d_precomputed);
-  clReleaseMemObject(d_filter_out);
-  clReleaseCommandQueue(queue);
+  if (failed) {
+    std::cerr << "OpenCL: Failed to rank the pixels\n";
+    return {};
+  }
   return dither_array;
 }
 #endif
@@ -1,17 +1,7 @@
 #version 450
 
-int twoToOne(int x, int y, int width, int height) {
-  while (x < 0) {
-    x += width;
-  }
-  while (y < 0) {
-    y += height;
-  }
-  x = x % width;
-  y = y % height;
-  return x + y * width;
-}
-
+// The folded quadrant of the kernel, the tap at offset (dx, dy) from the center
+// is at |dy| * (filter_size / 2 + 1) + |dx|.
 layout(binding = 0) readonly buffer PreComputed { float precomputed[]; };
 
 layout(binding = 1) writeonly buffer FilterOut { float filter_out[]; };
@@ -35,15 +25,32 @@ void main() {
   int x = int(index % width);
   int y = int(index / width);
 
+  // Wrap the window's first row and column once, stepping through the window
+  // then only needs a compare and reset instead of a modulo per tap. GLSL's %
+  // is undefined for negative operands, so whole periods are added first.
+  int first_column =
+      (x - filter_size / 2 + width * (filter_size / (2 * width) + 1)) % width;
+  int row =
+      (y - filter_size / 2 + height * (filter_size / (2 * height) + 1)) %
+      height;
+
+  int radius = filter_size / 2;
   float sum = 0.0F;
   for (int q = 0; q < filter_size; ++q) {
-    int q_prime = height - filter_size / 2 + y + q;
+    int row_start = row * width;
+    int precomputed_row = abs(q - radius) * (radius + 1);
+    int column = first_column;
     for (int p = 0; p < filter_size; ++p) {
-      int p_prime = width - filter_size / 2 + x + p;
-      if (pbp[twoToOne(p_prime, q_prime, width, height)] != 0) {
-        sum += precomputed[twoToOne(p, q, filter_size, filter_size)];
+      if (pbp[row_start + column] != 0) {
+        sum += precomputed[precomputed_row + abs(p - radius)];
+      }
+      if (++column == width) {
+        column = 0;
       }
     }
+    if (++row == height) {
+      row = 0;
+    }
   }
 
   filter_out[index] = sum;
@@ -8,11 +8,14 @@
 #include <vulkan/vulkan.h>
 #endif
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cmath>
 #include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <limits>
@@ -22,20 +25,104 @@
 #include <stdexcept>
 #include <thread>
 #include <tuple>
+#include <type_traits>
 #include <unordered_set>
 #include <vector>
 
 #include "image.hpp"
+#include "minmax_tree.hpp"
+#include "pattern.hpp"
+#include "rank_batch.hpp"
+#include "simd.hpp"
+#include "torus.hpp"
 #include "utility.hpp"
 
 namespace dither {
 
+/// How full recomputes of the energy field are done.
+enum class filter_mode {
+  /// Picks Separable or FFT from the image and kernel size.
+  Auto,
+  /// Sums the kernel window around every pixel.
+  Direct,
+  /// Circular convolution through the frequency domain.
+  FFT,
+  /// A horizontal then a vertical pass of the 1D gaussian.
+  Separable,
+};
+
+/// How the CPU engine picks the pattern its first phase starts from.
+enum class initial_pattern {
+  /// 40% of the pixels set uniformly at random.
+  WhiteNoise,
+  /// A half-size pattern, itself seeded and refined the same way, upsampled
+  /// with jitter. Falls back to WhiteNoise for odd or small sizes.
+  CoarseToFine,
+  /// Dart throwing with a shrinking minimum distance, see
+  /// internal::poisson_disk_noise().
+  PoissonDisk,
+};
+
+/// Tunables for blue-noise generation shared by the CPU, OpenCL and Vulkan
+/// paths.
+struct Options {
+  Options();
+
+  /// Radius of the gaussian kernel in pixels. 0 derives the radius from mu
+  /// and kernel_tolerance, a negative value uses the full-image window.
+  int kernel_radius;
+  /// Largest gaussian tap, relative to the center tap, that may be cut off
+  /// when kernel_radius is 0.
+  float kernel_tolerance;
+  filter_mode filter;
+  /// Derive the energies of the inverted pattern, used to rank the last half
+  /// of the pixels, from the current field instead of recomputing them.
+  bool complement_energy;
+  /// Keep the CPU engine's energies as 32-bit fixed-point sums of a
+  /// quantized kernel. Incremental updates are then exact and never need a
+  /// full recompute to undo drift.
+  bool fixed_point;
+  initial_pattern initial;
+  /// Run the CPU engine's first phase as parallel rounds of independent
+  /// swaps, see internal::parallel_remove_clusters().
+  bool parallel_swaps;
+  /// Most pixels ranked per energy evaluation, 1 ranks exactly one at a time.
+  /// See internal::RankBatchPicker.
+  int rank_batch;
+  /// Store the CPU engine's energies and pattern in 8x8 tiles instead of
+  /// rows, see internal::TiledTorus.
+  bool tiled_layout;
+  /// Indices into internal::cl_list_devices() of the OpenCL devices to use.
+  /// Empty picks the first GPU, or the first device if there is none. With
+  /// more than one, each device computes the energies of a range of rows.
+  std::vector<int> cl_devices;
+};
+
 image::Bl blue_noise(int width, int height, int threads = 1,
-                     bool use_opencl = true, bool use_vulkan = true);
+                     bool use_opencl = true, bool use_vulkan = true,
+                     const Options &options = Options());
 
 namespace internal {
-std::vector<unsigned int> blue_noise_impl(int width, int height,
-                                          int threads = 1);
+/// The CPU path, returns the finished image.
+image::Bl blue_noise_impl(int width, int height, int threads = 1,
+                          const Options &options = Options());
+
+/// Smallest side of the coarsest level of initial_pattern::CoarseToFine.
+constexpr int coarse_min_size = 64;
+
+/// Returns the width x height starting pattern for "options.initial", with
+/// about 40% of the pixels set. The swaps spent refining coarser levels are
+/// added to "coarse_swaps".
+Pattern make_initial_pattern(int width, int height, const Options &options,
+                             utility::ThreadPool &pool, int *coarse_swaps);
+
+/// The CPU engine behind blue_noise_impl() for a Torus, FixedTorus or
+/// TiledTorus "torus", with float or std::int32_t fixed-point energies.
+/// blue_noise_impl() picks the FixedTorus matching the image and kernel if one
+/// is instantiated. Ranks are returned in the layout of "torus".
+template <typename Geometry, typename Energy>
+std::vector<unsigned int> blue_noise_engine(const Geometry &torus, int threads,
+                                            const Options &options);
 
 #if DITHERING_VULKAN_ENABLED == 1
 struct QueueFamilyIndices {
@@ -76,7 +163,7 @@ std::vector<unsigned int> blue_noise_vulkan_impl(
     VkCommandBuffer command_buffer, VkCommandPool command_pool, VkQueue queue,
     VkBuffer pbp_buf, VkPipeline pipeline, VkPipelineLayout pipeline_layout,
     VkDescriptorSet descriptor_set, VkBuffer filter_out_buf, const int width,
-    const int height);
+    const int height, const Options &options);
 
 std::vector<float> vulkan_buf_to_vec(float *mapped, unsigned int size);
 
@@ -183,11 +270,28 @@ inline bool vulkan_get_filter(
 #endif
 
 #if DITHERING_OPENCL_ENABLED == 1
-std::vector<unsigned int> blue_noise_cl_impl(const int width, const int height,
-                                             const int filter_size,
-                                             cl_context context,
-                                             cl_device_id device,
-                                             cl_program program);
+/// Every OpenCL device of every platform, CPUs and accelerators included, in
+/// the order options.cl_devices indexes them. Prints each with its index.
+std::vector<cl_device_id> cl_list_devices();
+
+/// A device with its own context and built program, one per device so that
+/// devices of different platforms can be used together.
+struct ClDevice {
+  cl_device_id device;
+  cl_context context;
+  cl_program program;
+};
+
+/// Builds the embedded OpenCL kernels for "device", loading the program
+/// binary cached by an earlier run for the same device, driver and source if
+/// there is one, and caching it otherwise. Returns nullptr on failure.
+cl_program build_cl_program(cl_context context, cl_device_id device);
+
+/// The OpenCL path. The energies are split by rows across "devices" and the
+/// min/max of each step is merged from the results of every device.
+std::vector<unsigned int> blue_noise_cl_impl(
+    const int width, const int height, const int filter_size,
+    const std::vector<ClDevice> &devices, const Options &options);
 #endif
 
 inline std::vector<bool> random_noise(int size, int subsize) {
@@ -216,6 +320,55 @@ inline std::vector<bool> random_noise(int size, int subsize) {
   return pbp;
 }
 
+/// Sets "subsize" of "width" x "height" pixels by dart throwing on the pixel
+/// grid. Each pass visits the pixels in a new random order and sets those with
+/// no set pixel closer than its minimum distance on the torus. The distance
+/// shrinks from 2 to sqrt(2) to 1 between passes, since the larger ones jam
+/// well below 40% density.
+inline std::vector<bool> poisson_disk_noise(int width, int height,
+                                            int subsize) {
+  const int size = width * height;
+  std::vector<bool> pbp(size);
+  std::vector<int> order(size);
+  for (int i = 0; i < size; ++i) {
+    order[i] = i;
+  }
+  std::default_random_engine re(std::random_device{}());
+
+  // Squared minimum distances of each pass.
+  constexpr int passes[] = {4, 2, 1};
+  int count = 0;
+  for (int min_distance_squared : passes) {
+    std::shuffle(order.begin(), order.end(), re);
+    const int reach = (int)std::ceil(std::sqrt((float)min_distance_squared));
+    for (int i = 0; count < subsize && i < size; ++i) {
+      const int idx = order[i];
+      if (pbp[idx]) {
+        continue;
+      }
+      const int x = idx % width;
+      const int y = idx / width;
+      bool free = true;
+      for (int dy = -reach; free && dy <= reach; ++dy) {
+        const int row = ((y + dy) % height + height) % height * width;
+        for (int dx = -reach; dx <= reach; ++dx) {
+          if (dx * dx + dy * dy < min_distance_squared &&
+              pbp[row + ((x + dx) % width + width) % width]) {
+            free = false;
+            break;
+          }
+        }
+      }
+      if (free) {
+        pbp[idx] = true;
+        ++count;
+      }
+    }
+  }
+
+  return pbp;
+}
+
 constexpr float mu = 1.5F;
 constexpr float mu_squared = mu * mu;
 constexpr float double_mu_squared = 2.0F * mu * mu;
@@ -224,6 +377,35 @@ inline float gaussian(float x, float y) {
   return std::exp(-(x * x + y * y) / (double_mu_squared));
 }
 
+/// Returns the smallest kernel radius past which every gaussian tap is at most
+/// "tolerance" times the center tap.
+inline int kernel_radius_from_tolerance(float tolerance) {
+  if (tolerance <= 0.0F || tolerance >= 1.0F) {
+    return 1;
+  }
+  int radius = (int)std::ceil(mu * std::sqrt(-2.0F * std::log(tolerance)));
+  return radius < 1 ? 1 : radius;
+}
+
+/// Returns the (odd) filter_size to use for a width x height image. The
+/// full-image window of (width + height) / 2 is only used if requested or if
+/// the truncated kernel would not be smaller.
+inline int get_filter_size(int width, int height, const Options &options) {
+  int full_size = (width + height) / 2;
+  if (full_size % 2 == 0) {
+    ++full_size;
+  }
+  if (options.kernel_radius < 0) {
+    return full_size;
+  }
+
+  int radius = options.kernel_radius;
+  if (radius == 0) {
+    radius = kernel_radius_from_tolerance(options.kernel_tolerance);
+  }
+  return radius * 2 + 1 < full_size ? radius * 2 + 1 : full_size;
+}
+
 inline std::vector<float> precompute_gaussian(int size) {
   std::vector<float> precomputed;
   if (size % 2 == 0) {
@@ -240,183 +422,648 @@ inline std::vector<float> precompute_gaussian(int size) {
   return precomputed;
 }
 
-inline float filter(const std::vector<bool> &pbp, int x, int y, int width,
-                    int height, int filter_size) {
-  float sum = 0.0f;
+/// Folds a full kernel table (as from precompute_gaussian()) into its
+/// quadrant: entry [|dy| * (filter_size / 2 + 1) + |dx|] holds the tap at
+/// offset (dx, dy) from the center. The gaussian only depends on dx^2 + dy^2,
+/// so the quadrant holds every tap in about a quarter of the memory.
+template <typename T>
+inline std::vector<T> fold_kernel(const std::vector<T> &full,
+                                  int filter_size) {
+  if (filter_size % 2 == 0) {
+    ++filter_size;
+  }
+  const int radius = filter_size / 2;
+  std::vector<T> quadrant((radius + 1) * (radius + 1));
+  for (int dy = 0; dy <= radius; ++dy) {
+    for (int dx = 0; dx <= radius; ++dx) {
+      quadrant[dy * (radius + 1) + dx] =
+          full[(dy + radius) * filter_size + dx + radius];
+    }
+  }
+  return quadrant;
+}
+
+/// Scale of fixed-point energies, 2^26. The mu = 1.5 gaussian sums to about
+/// 14.14 over any window, so fixed-point energies stay below 2^30.
+constexpr double fixed_point_scale = 67108864.0;
+
+/// Returns the kernel taps in the "Energy" representation, "precomputed"
+/// itself for float and the taps rounded to fixed-point for std::int32_t.
+template <typename Energy>
+inline std::vector<Energy> kernel_taps(const std::vector<float> &precomputed) {
+  if constexpr (std::is_same<Energy, float>::value) {
+    return precomputed;
+  } else {
+    std::vector<Energy> taps(precomputed.size());
+    for (std::size_t i = 0; i < precomputed.size(); ++i) {
+      taps[i] = (Energy)std::llround(precomputed[i] * fixed_point_scale);
+    }
+    return taps;
+  }
+}
 
+/// Copies pbp into a (width + filter_size - 1) x (height + filter_size - 1)
+/// row-major array of 0/1 with a toroidal halo of filter_size / 2 on every
+/// side, so no filter window centered on the image needs to wrap.
+template <typename T = float>
+inline std::vector<T> pad_pattern(const PatternView &pbp, int width,
+                                  int height, int filter_size) {
   if (filter_size % 2 == 0) {
     ++filter_size;
   }
+  const int padded_width = width + filter_size - 1;
+  const int padded_height = height + filter_size - 1;
+  const auto wrap = [](int value, int size) {
+    value %= size;
+    return value < 0 ? value + size : value;
+  };
+
+  std::vector<int> columns(padded_width);
+  for (int i = 0; i < padded_width; ++i) {
+    columns[i] = wrap(i - filter_size / 2, width);
+  }
 
-  // Should be range -M/2 to M/2, but size_t cannot be negative, so range
-  // is 0 to M.
-  // p' = (M + x - (p - M/2)) % M = (3M/2 + x - p) % M
-  // q' = (N + y - (q - M/2)) % N = (N + M/2 + y - q) % N
-  for (int q = 0; q < filter_size; ++q) {
-    int q_prime = (height - filter_size / 2 + y + q) % height;
-    for (int p = 0; p < filter_size; ++p) {
-      int p_prime = (width - filter_size / 2 + x + p) % width;
-      if (pbp[utility::twoToOne(p_prime, q_prime, width, height)]) {
-        sum += gaussian(p - filter_size / 2, q - filter_size / 2);
-      }
+  std::vector<T> padded(padded_width * padded_height);
+  for (int j = 0; j < padded_height; ++j) {
+    const int row = wrap(j - filter_size / 2, height) * width;
+    T *out = padded.data() + j * padded_width;
+    for (int i = 0; i < padded_width; ++i) {
+      out[i] = pbp[row + columns[i]] ? 1 : 0;
     }
   }
 
-  return sum;
+  return padded;
 }
 
-inline float filter_with_precomputed(const std::vector<bool> &pbp, int x, int y,
-                                     int width, int height, int filter_size,
-                                     const std::vector<float> &precomputed) {
-  float sum = 0.0f;
+/// Sum of every kernel tap, the energy of any pixel of a fully set pattern.
+inline float kernel_mass(const std::vector<float> &precomputed) {
+  double mass = 0.0;
+  for (float tap : precomputed) {
+    mass += tap;
+  }
+  return (float)mass;
+}
 
+inline std::int32_t kernel_mass(const std::vector<std::int32_t> &taps) {
+  std::int64_t mass = 0;
+  for (std::int32_t tap : taps) {
+    mass += tap;
+  }
+  assert(mass <= std::numeric_limits<std::int32_t>::max() &&
+         "fixed_point_scale is too large for this kernel");
+  return (std::int32_t)mass;
+}
+
+/// Turns the energy field of a pattern into the field of its inverse in
+/// place. Every pixel's window holds the whole kernel, so the inverse
+/// pattern's energy is "mass" minus the pattern's energy.
+template <typename T>
+inline void complement_filter(T *filter, int size, T mass) {
+  for (int i = 0; i < size; ++i) {
+    filter[i] = mass - filter[i];
+  }
+}
+
+/// Returns the concrete mode to use in place of filter_mode::Auto.
+inline filter_mode resolve_filter_mode(filter_mode mode, int width, int height,
+                                       int filter_size) {
+  if (mode != filter_mode::Auto) {
+    return mode;
+  }
   if (filter_size % 2 == 0) {
     ++filter_size;
   }
+  // The separable passes cost 2 * filter_size taps per pixel, the transforms
+  // cost roughly a fixed multiple of log2(width * height). The direct path
+  // (filter_size^2 taps) never wins against the separable one.
+  int log_size = 0;
+  while ((1 << log_size) < width * height) {
+    ++log_size;
+  }
+  return filter_size > log_size * 2 ? filter_mode::FFT
+                                    : filter_mode::Separable;
+}
 
-  for (int q = 0; q < filter_size; ++q) {
-    int q_prime = (height - filter_size / 2 + y + q) % height;
-    for (int p = 0; p < filter_size; ++p) {
-      int p_prime = (width - filter_size / 2 + x + p) % width;
-      if (pbp[utility::twoToOne(p_prime, q_prime, width, height)]) {
-        sum += precomputed[utility::twoToOne(p, q, filter_size, filter_size)];
+/// Computes the whole energy field as a row pass followed by a column pass of
+/// the 1D gaussian, using gaussian(x, y) == gaussian(x, 0) * gaussian(0, y).
+/// Both passes only do multiply-adds over contiguous rows.
+inline void compute_filter_separable(const PatternView &pbp, int width,
+                                     int height, int filter_size,
+                                     std::vector<float> &filter_out,
+                                     utility::ThreadPool *pool = nullptr) {
+  if (filter_size % 2 == 0) {
+    ++filter_size;
+  }
+
+  std::vector<float> taps(filter_size);
+  for (int p = 0; p < filter_size; ++p) {
+    taps[p] = gaussian(p - filter_size / 2, 0.0F);
+  }
+
+  // Row pass over the halo-padded pattern, the window never needs to wrap.
+  const std::vector<float> padded =
+      pad_pattern(pbp, width, height, filter_size);
+  const int padded_width = width + filter_size - 1;
+  std::vector<float> rows(width * height, 0.0F);
+  const auto row_pass = [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++y) {
+      const float *src =
+          padded.data() + (y + filter_size / 2) * padded_width;
+      float *row = rows.data() + y * width;
+      for (int p = 0; p < filter_size; ++p) {
+        simd::axpy(row, src + p, taps[p], width);
       }
     }
-  }
+  };
+
+  // Column pass, accumulated a whole row at a time.
+  const auto column_pass = [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++y) {
+      float *out = filter_out.data() + y * width;
+      for (int x = 0; x < width; ++x) {
+        out[x] = 0.0F;
+      }
+      for (int q = 0; q < filter_size; ++q) {
+        const float *src =
+            rows.data() +
+            utility::twoToOne(0, y - filter_size / 2 + q, width, height);
+        simd::axpy(out, src, taps[q], width);
+      }
+    }
+  };
 
-  return sum;
+  if (pool) {
+    pool->parallel_for(0, height, row_pass);
+    pool->parallel_for(0, height, column_pass);
+  } else {
+    row_pass(0, height);
+    column_pass(0, height);
+  }
 }
 
-inline void compute_filter(const std::vector<bool> &pbp, int width, int height,
-                           int count, int filter_size,
-                           std::vector<float> &filter_out,
+/// Computes the whole energy field as the circular convolution of pbp with
+/// the kernel through the FFT. The kernel spectrum is cached per image and
+/// filter size.
+void compute_filter_fft(const PatternView &pbp, int width, int height,
+                        int filter_size, std::vector<float> &filter_out,
+                        const std::vector<float> *precomputed,
+                        utility::ThreadPool *pool = nullptr);
+
+/// Computes the energy of every pixel of pbp into filter_out. Rows are split
+/// across "pool" if given.
+inline void compute_filter(const PatternView &pbp, int width, int height,
+                           int filter_size, std::vector<float> &filter_out,
                            const std::vector<float> *precomputed = nullptr,
-                           int threads = 1) {
-  if (threads == 1) {
-    if (precomputed) {
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          filter_out[utility::twoToOne(x, y, width, height)] =
-              internal::filter_with_precomputed(pbp, x, y, width, height,
-                                                filter_size, *precomputed);
+                           utility::ThreadPool *pool = nullptr,
+                           filter_mode mode = filter_mode::Direct) {
+  mode = resolve_filter_mode(mode, width, height, filter_size);
+  if (mode == filter_mode::FFT) {
+    compute_filter_fft(pbp, width, height, filter_size, filter_out,
+                       precomputed, pool);
+    return;
+  } else if (mode == filter_mode::Separable) {
+    compute_filter_separable(pbp, width, height, filter_size, filter_out,
+                             pool);
+    return;
+  }
+
+  if (filter_size % 2 == 0) {
+    ++filter_size;
+  }
+  std::vector<float> gaussian_table;
+  if (!precomputed) {
+    gaussian_table = precompute_gaussian(filter_size);
+    precomputed = &gaussian_table;
+  }
+
+  // Each output row accumulates every kernel tap times the matching shifted
+  // row of the halo-padded pattern. Per pixel the taps are still summed in
+  // (q, p) order, and unset pixels only add zero.
+  const std::vector<float> padded =
+      pad_pattern(pbp, width, height, filter_size);
+  const int padded_width = width + filter_size - 1;
+  const int radius = filter_size / 2;
+  const std::vector<float> quadrant = fold_kernel(*precomputed, filter_size);
+  const auto compute_rows = [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++y) {
+      float *out = filter_out.data() + y * width;
+      std::fill(out, out + width, 0.0F);
+      for (int q = 0; q < filter_size; ++q) {
+        const float *src = padded.data() + (y + q) * padded_width;
+        const float *kernel_row =
+            quadrant.data() + std::abs(q - radius) * (radius + 1);
+        for (int p = 0; p < filter_size; ++p) {
+          simd::axpy(out, src + p, kernel_row[std::abs(p - radius)], width);
         }
       }
-    } else {
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          filter_out[utility::twoToOne(x, y, width, height)] =
-              internal::filter(pbp, x, y, width, height, filter_size);
+    }
+  };
+
+  if (pool) {
+    pool->parallel_for(0, height, compute_rows);
+  } else {
+    compute_rows(0, height);
+  }
+}
+
+/// Computes the whole fixed-point energy field of pbp from the quantized
+/// kernel "taps". Integer sums do not depend on their order, so this matches
+/// any sequence of update_filter() calls exactly. Only the direct and FFT
+/// paths are exact, any other mode uses the direct one.
+void compute_filter_fixed_fft(const PatternView &pbp, int width, int height,
+                              int filter_size,
+                              std::vector<std::int32_t> &filter_out,
+                              const std::vector<std::int32_t> &taps,
+                              utility::ThreadPool *pool = nullptr);
+
+inline void compute_filter_fixed(const PatternView &pbp, int width, int height,
+                                 int filter_size,
+                                 std::vector<std::int32_t> &filter_out,
+                                 const std::vector<std::int32_t> &taps,
+                                 utility::ThreadPool *pool = nullptr,
+                                 filter_mode mode = filter_mode::Direct) {
+  if (resolve_filter_mode(mode, width, height, filter_size) ==
+      filter_mode::FFT) {
+    compute_filter_fixed_fft(pbp, width, height, filter_size, filter_out, taps,
+                             pool);
+    return;
+  }
+
+  if (filter_size % 2 == 0) {
+    ++filter_size;
+  }
+  const std::vector<std::int32_t> padded =
+      pad_pattern<std::int32_t>(pbp, width, height, filter_size);
+  const int padded_width = width + filter_size - 1;
+  const int radius = filter_size / 2;
+  const std::vector<std::int32_t> quadrant = fold_kernel(taps, filter_size);
+  const auto compute_rows = [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++y) {
+      std::int32_t *out = filter_out.data() + y * width;
+      std::fill(out, out + width, 0);
+      for (int q = 0; q < filter_size; ++q) {
+        const std::int32_t *src = padded.data() + (y + q) * padded_width;
+        const std::int32_t *kernel_row =
+            quadrant.data() + std::abs(q - radius) * (radius + 1);
+        for (int p = 0; p < filter_size; ++p) {
+          const std::int32_t tap = kernel_row[std::abs(p - radius)];
+          for (int x = 0; x < width; ++x) {
+            out[x] += tap * src[p + x];
+          }
         }
       }
     }
+  };
+
+  if (pool) {
+    pool->parallel_for(0, height, compute_rows);
   } else {
-    if (threads == 0) {
-      threads = 10;
-    }
-    int active_count = 0;
-    std::mutex cv_mutex;
-    std::condition_variable cv;
-    if (precomputed) {
-      for (int i = 0; i < count; ++i) {
-        {
-          std::unique_lock lock(cv_mutex);
-          active_count += 1;
-        }
-        std::thread t(
-            [](int *ac, std::mutex *cvm, std::condition_variable *cv, int i,
-               const std::vector<bool> *pbp, int width, int height,
-               int filter_size, std::vector<float> *fout,
-               const std::vector<float> *precomputed) {
-              int x, y;
-              std::tie(x, y) = utility::oneToTwo(i, width);
-              (*fout)[i] = internal::filter_with_precomputed(
-                  *pbp, x, y, width, height, filter_size, *precomputed);
-              std::unique_lock lock(*cvm);
-              *ac -= 1;
-              cv->notify_all();
-            },
-            &active_count, &cv_mutex, &cv, i, &pbp, width, height, filter_size,
-            &filter_out, precomputed);
-        t.detach();
-
-        std::unique_lock lock(cv_mutex);
-        while (active_count >= threads) {
-          cv.wait_for(lock, std::chrono::seconds(1));
-        }
+    compute_rows(0, height);
+  }
+}
+
+/// Number of single-pixel filter updates between full recomputes of the
+/// energy field, bounding the float drift of incremental updates.
+constexpr int filter_resync_interval = 4096;
+
+/// Copies a row-major pattern into the layout of "torus", or the other way
+/// around if "to_row_major".
+template <typename Geometry>
+inline Pattern relayout_pattern(const Geometry &torus, const PatternView &pbp,
+                                bool to_row_major) {
+  std::vector<bool> out(torus.size());
+  for (int y = 0; y < torus.height(); ++y) {
+    for (int x = 0; x < torus.width(); ++x) {
+      const int row_major = x + y * torus.width();
+      if (to_row_major) {
+        out[row_major] = pbp[torus.index(x, y)];
+      } else {
+        out[torus.index(x, y)] = pbp[row_major];
       }
-    } else {
-      for (int i = 0; i < count; ++i) {
-        {
-          std::unique_lock lock(cv_mutex);
-          active_count += 1;
+    }
+  }
+  return Pattern(out);
+}
+
+/// Adds (or subtracts if "add" is false) the toroidally wrapped gaussian
+/// contribution of the pixel at "idx" to "filter_out", keeping it equal to
+/// what compute_filter() would produce after toggling that pixel. "torus" is
+/// a Torus, FixedTorus or TiledTorus, "Energy" is float or std::int32_t.
+template <typename Geometry, typename Energy>
+inline void update_filter(const Geometry &torus,
+                          std::vector<Energy> &filter_out, int idx,
+                          const std::vector<Energy> &precomputed, bool add) {
+  const int width = torus.width();
+  const int filter_size = torus.filter_size();
+  const Energy sign = add ? 1 : -1;
+  const int first_column = torus.wrap_x(torus.x_of(idx) - filter_size / 2);
+  const int first_row = torus.y_of(idx) - filter_size / 2;
+
+  // The gaussian is symmetric, so the pixel at (x, y) contributes
+  // precomputed[p, q] to the value at (x - M/2 + p, y - M/2 + q). Each kernel
+  // row is added in contiguous runs up to the right edge of the image, or of
+  // a tile.
+  if constexpr (Geometry::is_tiled) {
+    for (int q = 0; q < filter_size; ++q) {
+      const int y = first_row + q;
+      const Energy *kernel_row = precomputed.data() + q * filter_size;
+      int column = first_column;
+      for (int p = 0; p < filter_size;) {
+        const int tile_left =
+            Geometry::tile_size - (column & (Geometry::tile_size - 1));
+        const int run = std::min(filter_size - p, tile_left);
+        Energy *out = filter_out.data() + torus.index(column, y);
+        if constexpr (std::is_same<Energy, float>::value) {
+          simd::axpy(out, kernel_row + p, sign, run);
+        } else {
+          for (int i = 0; i < run; ++i) {
+            out[i] += sign * kernel_row[p + i];
+          }
         }
-        std::thread t(
-            [](int *ac, std::mutex *cvm, std::condition_variable *cv, int i,
-               const std::vector<bool> *pbp, int width, int height,
-               int filter_size, std::vector<float> *fout) {
-              int x, y;
-              std::tie(x, y) = utility::oneToTwo(i, width);
-              (*fout)[i] =
-                  internal::filter(*pbp, x, y, width, height, filter_size);
-              std::unique_lock lock(*cvm);
-              *ac -= 1;
-              cv->notify_all();
-            },
-            &active_count, &cv_mutex, &cv, i, &pbp, width, height, filter_size,
-            &filter_out);
-        t.detach();
-
-        std::unique_lock lock(cv_mutex);
-        while (active_count >= threads) {
-          cv.wait_for(lock, std::chrono::seconds(1));
+        p += run;
+        column = torus.wrap_x(column + run);
+      }
+    }
+    return;
+  }
+  for (int q = 0; q < filter_size; ++q) {
+    Energy *row = filter_out.data() + torus.wrap_y(first_row + q) * width;
+    const Energy *kernel_row = precomputed.data() + q * filter_size;
+    if constexpr (Geometry::is_fixed) {
+      // Constant trip count, left for the compiler to unroll and vectorize.
+      // The sign is +-1 so this rounds exactly like simd::axpy().
+      if (first_column + filter_size <= width) {
+        Energy *out = row + first_column;
+        for (int p = 0; p < filter_size; ++p) {
+          out[p] += sign * kernel_row[p];
         }
+        continue;
       }
     }
-    std::unique_lock lock(cv_mutex);
-    while (active_count > 0) {
-      cv.wait_for(lock, std::chrono::seconds(1));
+    int column = first_column;
+    for (int p = 0; p < filter_size;) {
+      const int run = std::min(filter_size - p, width - column);
+      if constexpr (std::is_same<Energy, float>::value) {
+        simd::axpy(row + column, kernel_row + p, sign, run);
+      } else {
+        for (int i = 0; i < run; ++i) {
+          row[column + i] += sign * kernel_row[p + i];
+        }
+      }
+      p += run;
+      column = 0;
     }
   }
 }
 
-inline std::pair<int, int> filter_minmax(const std::vector<float> &filter,
-                                         std::vector<bool> pbp) {
-  // ensure minority pixel is "true"
-  unsigned int count = 0;
-  for (bool value : pbp) {
-    if (value) {
-      ++count;
+/// Calls "fn(begin, end)" for each run of contiguous indices touched by
+/// update_filter() at "idx", without repeating a row when the window wraps
+/// onto itself.
+template <typename Geometry, typename Fn>
+inline void for_each_filter_span(const Geometry &torus, int idx, Fn &&fn) {
+  const int width = torus.width();
+  const int height = torus.height();
+  const int filter_size = torus.filter_size();
+  const int rows = std::min(filter_size, height);
+  const int first_row =
+      filter_size >= height ? 0 : torus.y_of(idx) - filter_size / 2;
+  const int first_column = torus.wrap_x(torus.x_of(idx) - filter_size / 2);
+
+  if constexpr (Geometry::is_tiled) {
+    // One run per row of tiles, tiles next to each other in a row are
+    // contiguous.
+    constexpr int tile_pixels = Geometry::tile_size * Geometry::tile_size;
+    const int row_pixels = torus.tiles_x() * tile_pixels;
+    const int first_tile = first_column / Geometry::tile_size;
+    const int last_tile =
+        torus.wrap_x(first_column + filter_size - 1) / Geometry::tile_size;
+    const bool wraps = first_column + filter_size > width;
+    const bool whole_rows =
+        filter_size >= width || (wraps && last_tile >= first_tile);
+    // Tile rows the window touches, all of them if it wraps onto itself.
+    const int tile_rows = torus.height() / Geometry::tile_size;
+    const int wrapped_first_row = torus.wrap_y(first_row);
+    const int first_tile_row = wrapped_first_row / Geometry::tile_size;
+    const int last_tile_row =
+        torus.wrap_y(first_row + rows - 1) / Geometry::tile_size;
+    int touched = (last_tile_row - first_tile_row + tile_rows) % tile_rows + 1;
+    if (rows >= height || (wrapped_first_row + rows > height &&
+                           last_tile_row >= first_tile_row)) {
+      touched = tile_rows;
     }
+    for (int t = 0; t < touched; ++t) {
+      const int row_start = (first_tile_row + t) % tile_rows * row_pixels;
+      if (whole_rows) {
+        fn(row_start, row_start + row_pixels);
+      } else if (!wraps) {
+        fn(row_start + first_tile * tile_pixels,
+           row_start + (last_tile + 1) * tile_pixels);
+      } else {
+        fn(row_start + first_tile * tile_pixels, row_start + row_pixels);
+        fn(row_start, row_start + (last_tile + 1) * tile_pixels);
+      }
+    }
+    return;
   }
-  if (count * 2 >= pbp.size()) {
-    // std::cout << "MINMAX flip\n"; // DEBUG
-    for (unsigned int i = 0; i < pbp.size(); ++i) {
-      pbp[i] = !pbp[i];
+
+  for (int q = 0; q < rows; ++q) {
+    const int row_start = torus.wrap_y(first_row + q) * width;
+    if (filter_size >= width) {
+      fn(row_start, row_start + width);
+    } else if (first_column + filter_size <= width) {
+      fn(row_start + first_column, row_start + first_column + filter_size);
+    } else {
+      fn(row_start + first_column, row_start + width);
+      fn(row_start, row_start + first_column + filter_size - width);
     }
   }
+}
 
-  float min = std::numeric_limits<float>::infinity();
-  float max = -std::numeric_limits<float>::infinity();
-  int min_index = -1;
-  int max_index = -1;
+/// First phase of void-and-cluster: moves the pixel of the tightest cluster
+/// into the largest void until the pixel removed is the one that would be put
+/// back. "toggle(idx, value)" sets a pixel of "pbp" and keeps "tree" in sync.
+/// Returns the number of swaps.
+template <typename Toggle>
+inline int remove_clusters(const MinMaxTree &tree, const Pattern &pbp,
+                           Toggle &&toggle) {
+  int swaps = 0;
+  while (true) {
+    int max;
+    std::tie(std::ignore, max) = tree.minmax(pbp);
+    toggle(max, false);
+
+    int second_min;
+    std::tie(second_min, std::ignore) = tree.minmax(pbp);
+    if (second_min == max) {
+      toggle(max, true);
+      return swaps;
+    }
+    toggle(second_min, true);
+    ++swaps;
+#ifndef NDEBUG
+    printf("Iteration %d\n", swaps);
+#endif
+  }
+}
 
-  for (std::vector<float>::size_type i = 0; i < filter.size(); ++i) {
-    if (!pbp[i] && filter[i] < min) {
-      min_index = i;
-      min = filter[i];
+/// Parallel rounds of the first phase, for patterns with less than half of
+/// the pixels set. The torus is cut into tiles at least four kernel windows
+/// wide and every round each tile swaps its own tightest cluster into its
+/// largest void, only looking at pixels a kernel radius or more away from its
+/// edges. Such swaps only change energies inside the tile, so tiles never
+/// interact and the result does not depend on the thread count. The tile grid
+/// shifts by half a tile every round so pixels near the edges get their turn.
+/// Stops once neither grid position swaps anything or after "max_rounds",
+/// calling "after_round(swaps)" after each round. "tree" is not kept up to
+/// date. Returns the number of swaps.
+template <typename Geometry, typename Energy, typename AfterRound>
+inline int parallel_remove_clusters(const Geometry &torus,
+                                    std::vector<Energy> &filter_out,
+                                    const std::vector<Energy> &taps,
+                                    Pattern &pbp, utility::ThreadPool &pool,
+                                    int max_rounds, AfterRound &&after_round) {
+  assert(pbp.count() * 2 < pbp.size());
+  const int width = torus.width();
+  const int height = torus.height();
+  const int radius = torus.filter_size() / 2;
+  const int columns = std::max(1, width / (4 * torus.filter_size()));
+  const int rows = std::max(1, height / (4 * torus.filter_size()));
+  if (columns * rows == 1) {
+    return 0;
+  }
+
+  std::vector<std::pair<int, int>> tile_swaps(columns * rows);
+  const auto swap_in_tile = [&](int tile, int x_offset, int y_offset) {
+    const int x_begin = x_offset + (tile % columns) * width / columns + radius;
+    const int x_end =
+        x_offset + (tile % columns + 1) * width / columns - radius;
+    const int y_begin = y_offset + (tile / columns) * height / rows + radius;
+    const int y_end = y_offset + (tile / columns + 1) * height / rows - radius;
+    // Scans the tile's interior for the min energy among unset pixels (and
+    // "freed") and the max among set ones, ties go to the first in scan
+    // order.
+    const auto scan = [&](int freed) {
+      int min = -1;
+      int max = -1;
+      for (int y = y_begin; y < y_end; ++y) {
+        for (int x = x_begin; x < x_end; ++x) {
+          const int idx = torus.index(x, y);
+          if (pbp[idx] && idx != freed) {
+            if (max < 0 || filter_out[idx] > filter_out[max]) {
+              max = idx;
+            }
+          } else if (min < 0 || filter_out[idx] < filter_out[min]) {
+            min = idx;
+          }
+        }
+      }
+      return std::make_pair(min, max);
+    };
+
+    tile_swaps[tile] = {-1, -1};
+    const int cluster = scan(-1).second;
+    if (cluster < 0) {
+      return;
     }
-    if (pbp[i] && filter[i] > max) {
-      max_index = i;
-      max = filter[i];
+    update_filter(torus, filter_out, cluster, taps, false);
+    const int void_idx = scan(cluster).first;
+    update_filter(torus, filter_out, void_idx, taps, true);
+    if (void_idx != cluster) {
+      tile_swaps[tile] = {cluster, void_idx};
+    }
+  };
+
+  int swaps = 0;
+  int idle_rounds = 0;
+  for (int round = 0; round < max_rounds && idle_rounds < 2; ++round) {
+    const int x_offset = round % 2 == 0 ? 0 : width / columns / 2;
+    const int y_offset = round % 2 == 0 ? 0 : height / rows / 2;
+    pool.parallel_for(0, columns * rows, [&](int first, int last) {
+      for (int tile = first; tile < last; ++tile) {
+        swap_in_tile(tile, x_offset, y_offset);
+      }
+    });
+
+    int round_swaps = 0;
+    for (const auto &swap : tile_swaps) {
+      if (swap.first >= 0) {
+        pbp.set(swap.first, false);
+        pbp.set(swap.second, true);
+        ++round_swaps;
+      }
     }
+    swaps += round_swaps;
+    idle_rounds = round_swaps == 0 ? idle_rounds + 1 : 0;
+    after_round(round_swaps);
   }
 
-  return {min_index, max_index};
+  return swaps;
 }
 
 inline std::pair<int, int> filter_minmax_raw_array(const float *const filter,
                                                    unsigned int size,
-                                                   std::vector<bool> pbp) {
+                                                   const PatternView &pbp) {
+  // the minority pixel is treated as "true", no copy of pbp is needed to
+  // flip it, the stored byte of a minority pixel is just flipped by the view
+  const bool minority = pbp.minority_value();
+  return simd::masked_minmax(filter, pbp.pattern().bytes(), size,
+                             minority != pbp.is_reversed() ? 1 : 0);
+}
+
+inline std::pair<int, int> filter_minmax(const std::vector<float> &filter,
+                                         const PatternView &pbp) {
+  return filter_minmax_raw_array(filter.data(), filter.size(), pbp);
+}
+
+/// filter_minmax() with the scan split across "pool". Every chunk reports
+/// its own extremes and they are merged by value, then by lowest index, the
+/// same rule the single-threaded scan follows, so the result is identical for
+/// any thread count.
+inline std::pair<int, int> filter_minmax(const std::vector<float> &filter,
+                                         const PatternView &pbp,
+                                         utility::ThreadPool *pool) {
+  if (!pool || pool->size() == 1) {
+    return filter_minmax(filter, pbp);
+  }
+
+  const int size = filter.size();
+  const int chunks = pool->size();
+  const std::uint8_t target =
+      pbp.minority_value() != pbp.is_reversed() ? 1 : 0;
+  std::vector<std::pair<int, int>> partials(chunks, {-1, -1});
+  pool->parallel_for(0, chunks, [&](int first, int last) {
+    for (int chunk = first; chunk < last; ++chunk) {
+      const int begin = (int)((long long)size * chunk / chunks);
+      const int end = (int)((long long)size * (chunk + 1) / chunks);
+      auto partial = simd::masked_minmax(filter.data() + begin,
+                                         pbp.pattern().bytes() + begin,
+                                         end - begin, target);
+      partials[chunk] = {partial.first < 0 ? -1 : partial.first + begin,
+                         partial.second < 0 ? -1 : partial.second + begin};
+    }
+  });
+
+  std::pair<int, int> result{-1, -1};
+  for (const auto &partial : partials) {
+    if (partial.first >= 0 &&
+        (result.first < 0 || filter[partial.first] < filter[result.first] ||
+         (filter[partial.first] == filter[result.first] &&
+          partial.first < result.first))) {
+      result.first = partial.first;
+    }
+    if (partial.second >= 0 &&
+        (result.second < 0 || filter[partial.second] > filter[result.second] ||
+         (filter[partial.second] == filter[result.second] &&
+          partial.second < result.second))) {
+      result.second = partial.second;
+    }
+  }
+  return result;
+}
+
+inline std::pair<int, int> filter_minmax_raw_array(
+    const float *const filter, unsigned int size,
+    const std::vector<bool> &pbp) {
   // ensure minority pixel is "true"
   unsigned int count = 0;
   for (bool value : pbp) {
@@ -424,12 +1071,7 @@ inline std::pair<int, int> filter_minmax_raw_array(const float *const filter,
       ++count;
     }
   }
-  if (count * 2 >= pbp.size()) {
-    // std::cout << "MINMAX flip\n"; // DEBUG
-    for (unsigned int i = 0; i < pbp.size(); ++i) {
-      pbp[i] = !pbp[i];
-    }
-  }
+  const bool minority = count * 2 < pbp.size();
 
   float min = std::numeric_limits<float>::infinity();
   float max = -std::numeric_limits<float>::infinity();
@@ -437,11 +1079,12 @@ inline std::pair<int, int> filter_minmax_raw_array(const float *const filter,
   int max_index = -1;
 
   for (unsigned int i = 0; i < size; ++i) {
-    if (!pbp[i] && filter[i] < min) {
+    const bool is_minority = pbp[i] == minority;
+    if (!is_minority && filter[i] < min) {
       min_index = i;
       min = filter[i];
     }
-    if (pbp[i] && filter[i] > max) {
+    if (is_minority && filter[i] > max) {
       max_index = i;
       max = filter[i];
     }
@@ -450,27 +1093,26 @@ inline std::pair<int, int> filter_minmax_raw_array(const float *const filter,
   return {min_index, max_index};
 }
 
-inline std::pair<int, int> filter_abs_minmax(const std::vector<float> &filter) {
-  float min = std::numeric_limits<float>::infinity();
-  float max = -std::numeric_limits<float>::infinity();
+inline std::pair<int, int> filter_minmax(const std::vector<float> &filter,
+                                         const std::vector<bool> &pbp) {
+  return filter_minmax_raw_array(filter.data(), filter.size(), pbp);
+}
+
+/// Returns the indices of the smallest and largest energy, ties go to the
+/// lowest index.
+template <typename T>
+inline std::pair<int, int> filter_abs_minmax(const std::vector<T> &filter) {
   int min_index = -1;
   int max_index = -1;
-
-  std::default_random_engine re(std::random_device{}());
-  std::size_t startIdx =
-      std::uniform_int_distribution<std::size_t>(0, filter.size() - 1)(re);
-
-  for (std::vector<float>::size_type i = startIdx; i < filter.size(); ++i) {
-    if (filter[i] < min) {
-      min_index = i;
-      min = filter[i];
-    }
-    if (filter[i] > max) {
-      max_index = i;
-      max = filter[i];
-    }
+  if (filter.empty()) {
+    return {min_index, max_index};
   }
-  for (std::vector<float>::size_type i = 0; i < startIdx; ++i) {
+  T min = filter[0];
+  T max = filter[0];
+  min_index = 0;
+  max_index = 0;
+
+  for (typename std::vector<T>::size_type i = 1; i < filter.size(); ++i) {
     if (filter[i] < min) {
       min_index = i;
       min = filter[i];
@@ -547,19 +1189,20 @@ inline int get_one_or_zero(const std::vector<bool> &pbp, bool get_one, int idx,
   return idx;
 }
 
-inline void write_filter(const std::vector<float> &filter, int width,
+template <typename T>
+inline void write_filter(const std::vector<T> &filter, int width,
                          const char *filename) {
   int min, max;
   std::tie(min, max) = filter_abs_minmax(filter);
 
-  printf("Writing to %s, min is %.3f, max is %.3f\n", filename, filter[min],
-         filter[max]);
+  const double low = filter[min];
+  const double high = filter[max];
+  printf("Writing to %s, min is %.3f, max is %.3f\n", filename, low, high);
   FILE *filter_image = fopen(filename, "w");
   fprintf(filter_image, "P2\n%d %d\n255\n", width, (int)filter.size() / width);
-  for (std::vector<float>::size_type i = 0; i < filter.size(); ++i) {
+  for (typename std::vector<T>::size_type i = 0; i < filter.size(); ++i) {
     fprintf(filter_image, "%d ",
-            (int)(((filter[i] - filter[min]) / (filter[max] - filter[min])) *
-                  255.0f));
+            (int)(((filter[i] - low) / (high - low)) * 255.0));
     if ((i + 1) % width == 0) {
       fputc('\n', filter_image);
     }
@@ -580,7 +1223,11 @@ inline image::Bl toBl(const std::vector<bool> &pbp, int width) {
   return bwImage;
 }
 
-inline image::Bl rangeToBl(const std::vector<unsigned int> &values, int width) {
+/// rangeToBl() for ranks stored in the layout of "torus", written out in
+/// row-major order.
+template <typename Geometry>
+inline image::Bl rangeToBl(const std::vector<unsigned int> &values,
+                           const Geometry &torus) {
   int min = std::numeric_limits<int>::max();
   int max = std::numeric_limits<int>::min();
 
@@ -600,57 +1247,151 @@ inline image::Bl rangeToBl(const std::vector<unsigned int> &values, int width) {
 
   max -= min;
 
-  image::Bl grImage(width, values.size() / width);
+  const int width = torus.width();
+  image::Bl grImage(width, torus.height());
   assert((unsigned long)grImage.getSize() >= values.size() &&
          "New image::Bl size too small (values' size is not a multiple of "
          "width)");
 
-  for (unsigned int i = 0; i < values.size(); ++i) {
-    grImage.getData()[i] =
-        std::round(((float)((int)(values[i]) - min) / (float)max) * 255.0F);
+  for (int y = 0; y < torus.height(); ++y) {
+    for (int x = 0; x < width; ++x) {
+      grImage.getData()[x + y * width] = std::round(
+          ((float)((int)(values[torus.index(x, y)]) - min) / (float)max) *
+          255.0F);
+    }
   }
 
   return grImage;
 }
 
-inline std::pair<int, int> filter_minmax_in_range(
-    int start, int width, int height, int range,
-    const std::vector<float> &vec) {
-  float max = -std::numeric_limits<float>::infinity();
-  float min = std::numeric_limits<float>::infinity();
+inline image::Bl rangeToBl(const std::vector<unsigned int> &values, int width) {
+  return rangeToBl(values, Torus(width, values.size() / width, 1));
+}
 
-  int maxIdx = -1;
-  int minIdx = -1;
+/// filter_minmax() over the "range" x "range" window around "center" only:
+/// the min energy among pixels other than "minority" and the max among those
+/// equal to it. Ties go to the lowest index, either index is -1 if the window
+/// has no such pixel.
+inline std::pair<int, int> filter_minmax_in_range(
+    int center, int width, int height, int range, const float *filter,
+    const std::vector<bool> &pbp, bool minority) {
+  int min_index = -1;
+  int max_index = -1;
 
-  auto startXY = utility::oneToTwo(start, width);
+  auto startXY = utility::oneToTwo(center, width);
   for (int y = startXY.second - range / 2; y <= startXY.second + range / 2;
        ++y) {
     for (int x = startXY.first - range / 2; x <= startXY.first + range / 2;
          ++x) {
       int idx = utility::twoToOne(x, y, width, height);
-      if (idx == start) {
-        continue;
+      if (pbp[idx] != minority) {
+        if (min_index < 0 || filter[idx] < filter[min_index] ||
+            (filter[idx] == filter[min_index] && idx < min_index)) {
+          min_index = idx;
+        }
+      } else if (max_index < 0 || filter[idx] > filter[max_index] ||
+                 (filter[idx] == filter[max_index] && idx < max_index)) {
+        max_index = idx;
       }
+    }
+  }
 
-      if (vec[idx] < min) {
-        min = vec[idx];
-        minIdx = idx;
-      }
+  return {min_index, max_index};
+}
+
+/// Keeps the result of filter_minmax() for the GPU paths, which read back the
+/// whole energy field after every toggle although only the energies within a
+/// kernel radius of the toggled pixel change. The windows around the pixels
+/// passed to toggled() are rescanned with filter_minmax_in_range() and merged
+/// with the cached pair. The whole field is only scanned again when a cached
+/// index lies inside one of those windows or the minority changes.
+class MinMaxCache {
+ public:
+  MinMaxCache(int width, int height, int filter_size)
+      : width_(width),
+        height_(height),
+        filter_size_(filter_size),
+        valid_(false),
+        minority_(false),
+        count_(0),
+        cached_(-1, -1),
+        toggled_() {}
+
+  /// Makes the next minmax() scan the whole field, for when every energy
+  /// changed.
+  void invalidate() {
+    valid_ = false;
+    toggled_.clear();
+  }
+
+  /// Records that the pixel "idx" was set to "value".
+  void toggled(int idx, bool value) {
+    toggled_.push_back(idx);
+    count_ += value ? 1 : -1;
+  }
 
-      if (vec[idx] > max) {
-        max = vec[idx];
-        maxIdx = idx;
+  /// Same result as filter_minmax(filter, pbp), given that only the toggled()
+  /// pixels changed since the last call.
+  std::pair<int, int> minmax(const float *filter,
+                             const std::vector<bool> &pbp) {
+    const int size = pbp.size();
+    bool rescan = !valid_ || (count_ * 2 < size) != minority_;
+    for (int idx : toggled_) {
+      rescan = rescan || in_window(idx, cached_.first) ||
+               in_window(idx, cached_.second);
+    }
+
+    if (rescan) {
+      count_ = std::count(pbp.begin(), pbp.end(), true);
+      minority_ = count_ * 2 < size;
+      cached_ = filter_minmax_raw_array(filter, size, pbp);
+      valid_ = true;
+    } else {
+      for (int idx : toggled_) {
+        const auto window = filter_minmax_in_range(
+            idx, width_, height_, filter_size_, filter, pbp, minority_);
+        if (window.first >= 0 &&
+            (cached_.first < 0 ||
+             filter[window.first] < filter[cached_.first] ||
+             (filter[window.first] == filter[cached_.first] &&
+              window.first < cached_.first))) {
+          cached_.first = window.first;
+        }
+        if (window.second >= 0 &&
+            (cached_.second < 0 ||
+             filter[window.second] > filter[cached_.second] ||
+             (filter[window.second] == filter[cached_.second] &&
+              window.second < cached_.second))) {
+          cached_.second = window.second;
+        }
       }
     }
+    toggled_.clear();
+    return cached_;
   }
 
-  if (minIdx < 0) {
-    throw std::runtime_error("Invalid minIdx value");
-  } else if (maxIdx < 0) {
-    throw std::runtime_error("Invalid maxIdx value");
+ private:
+  /// Whether "idx" is within the kernel window centered on "center".
+  bool in_window(int center, int idx) const {
+    if (idx < 0) {
+      return false;
+    }
+    int dx = std::abs(idx % width_ - center % width_);
+    int dy = std::abs(idx / width_ - center / width_);
+    dx = std::min(dx, width_ - dx);
+    dy = std::min(dy, height_ - dy);
+    return dx <= filter_size_ / 2 && dy <= filter_size_ / 2;
   }
-  return {minIdx, maxIdx};
-}
+
+  int width_;
+  int height_;
+  int filter_size_;
+  bool valid_;
+  bool minority_;
+  int count_;
+  std::pair<int, int> cached_;
+  std::vector<int> toggled_;
+};
 }  // namespace internal
 
 }  // namespace dither
@@ -0,0 +1,158 @@
+#include "fft.hpp"
+
+#include <cmath>
+
+namespace {
+constexpr double pi = 3.14159265358979323846;
+}  // namespace
+
+fft::Plan::Plan(int size)
+    : size_(size),
+      pow2_size_(1),
+      bit_reverse_(),
+      twiddles_(),
+      chirp_(),
+      chirp_spectrum_() {
+  if ((size & (size - 1)) == 0) {
+    pow2_size_ = size;
+  } else {
+    // Bluestein needs a linear convolution of length 2 * size - 1.
+    while (pow2_size_ < size * 2 - 1) {
+      pow2_size_ *= 2;
+    }
+  }
+
+  int bits = 0;
+  while ((1 << bits) < pow2_size_) {
+    ++bits;
+  }
+  bit_reverse_.resize(pow2_size_);
+  for (int i = 0; i < pow2_size_; ++i) {
+    int reversed = 0;
+    for (int b = 0; b < bits; ++b) {
+      if (i & (1 << b)) {
+        reversed |= 1 << (bits - 1 - b);
+      }
+    }
+    bit_reverse_[i] = reversed;
+  }
+
+  twiddles_.resize(pow2_size_ / 2);
+  for (int i = 0; i < pow2_size_ / 2; ++i) {
+    twiddles_[i] = std::polar(1.0, -2.0 * pi * i / pow2_size_);
+  }
+
+  if (pow2_size_ != size_) {
+    // chirp_[n] = exp(-i * pi * n^2 / size), n^2 is reduced modulo 2 * size
+    // to keep the angle accurate for large n.
+    chirp_.resize(size_);
+    for (int n = 0; n < size_; ++n) {
+      long long n_squared = ((long long)n * n) % (2LL * size_);
+      chirp_[n] = std::polar(1.0, -pi * (double)n_squared / size_);
+    }
+    chirp_spectrum_.assign(pow2_size_, {0.0, 0.0});
+    chirp_spectrum_[0] = std::conj(chirp_[0]);
+    for (int n = 1; n < size_; ++n) {
+      chirp_spectrum_[n] = std::conj(chirp_[n]);
+      chirp_spectrum_[pow2_size_ - n] = std::conj(chirp_[n]);
+    }
+    radix2(chirp_spectrum_.data(), false);
+  }
+}
+
+int fft::Plan::size() const { return size_; }
+
+void fft::Plan::transform(std::complex<double> *data, int stride, bool inverse,
+                          std::vector<std::complex<double>> &scratch) const {
+  scratch.resize(pow2_size_);
+
+  if (pow2_size_ == size_) {
+    for (int i = 0; i < size_; ++i) {
+      scratch[i] = data[i * stride];
+    }
+    radix2(scratch.data(), inverse);
+    for (int i = 0; i < size_; ++i) {
+      data[i * stride] = scratch[i];
+    }
+    return;
+  }
+
+  // The inverse is the conjugate of the forward transform of the conjugate.
+  for (int i = 0; i < size_; ++i) {
+    std::complex<double> value =
+        inverse ? std::conj(data[i * stride]) : data[i * stride];
+    scratch[i] = value * chirp_[i];
+  }
+  for (int i = size_; i < pow2_size_; ++i) {
+    scratch[i] = {0.0, 0.0};
+  }
+  radix2(scratch.data(), false);
+  for (int i = 0; i < pow2_size_; ++i) {
+    scratch[i] *= chirp_spectrum_[i];
+  }
+  radix2(scratch.data(), true);
+  const double scale = 1.0 / pow2_size_;
+  for (int i = 0; i < size_; ++i) {
+    std::complex<double> value = scratch[i] * chirp_[i] * scale;
+    data[i * stride] = inverse ? std::conj(value) : value;
+  }
+}
+
+void fft::Plan::radix2(std::complex<double> *data, bool inverse) const {
+  for (int i = 0; i < pow2_size_; ++i) {
+    if (i < bit_reverse_[i]) {
+      std::swap(data[i], data[bit_reverse_[i]]);
+    }
+  }
+
+  for (int length = 2; length <= pow2_size_; length *= 2) {
+    const int half = length / 2;
+    const int twiddle_step = pow2_size_ / length;
+    for (int start = 0; start < pow2_size_; start += length) {
+      for (int k = 0; k < half; ++k) {
+        std::complex<double> twiddle = twiddles_[k * twiddle_step];
+        if (inverse) {
+          twiddle = std::conj(twiddle);
+        }
+        std::complex<double> odd = data[start + k + half] * twiddle;
+        data[start + k + half] = data[start + k] - odd;
+        data[start + k] += odd;
+      }
+    }
+  }
+}
+
+void fft::transform_2d(std::vector<std::complex<double>> &data,
+                       const Plan &row_plan, const Plan &column_plan,
+                       bool inverse, utility::ThreadPool *pool) {
+  const int width = row_plan.size();
+  const int height = column_plan.size();
+
+  const auto transform_rows = [&](int y_begin, int y_end) {
+    std::vector<std::complex<double>> scratch;
+    for (int y = y_begin; y < y_end; ++y) {
+      row_plan.transform(data.data() + y * width, 1, inverse, scratch);
+    }
+  };
+  const auto transform_columns = [&](int x_begin, int x_end) {
+    std::vector<std::complex<double>> scratch;
+    for (int x = x_begin; x < x_end; ++x) {
+      column_plan.transform(data.data() + x, width, inverse, scratch);
+    }
+  };
+
+  if (pool) {
+    pool->parallel_for(0, height, transform_rows);
+    pool->parallel_for(0, width, transform_columns);
+  } else {
+    transform_rows(0, height);
+    transform_columns(0, width);
+  }
+
+  if (inverse) {
+    const double scale = 1.0 / ((double)width * height);
+    for (auto &value : data) {
+      value *= scale;
+    }
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef DITHERING_FFT_HPP
+#define DITHERING_FFT_HPP
+
+#include <complex>
+#include <vector>
+
+#include "utility.hpp"
+
+namespace fft {
+/// Twiddle factors for complex FFTs of one fixed length. Power of two
+/// lengths use an iterative radix-2 transform, any other length goes through
+/// Bluestein's algorithm on a padded power of two transform.
+class Plan {
+ public:
+  explicit Plan(int size);
+
+  int size() const;
+
+  /// Transforms "size()" elements of "data" spaced "stride" apart in place.
+  /// The inverse transform is not normalized.
+  void transform(std::complex<double> *data, int stride, bool inverse,
+                 std::vector<std::complex<double>> &scratch) const;
+
+ private:
+  void radix2(std::complex<double> *data, bool inverse) const;
+
+  int size_;
+  int pow2_size_;
+  std::vector<int> bit_reverse_;
+  std::vector<std::complex<double>> twiddles_;
+  std::vector<std::complex<double>> chirp_;
+  std::vector<std::complex<double>> chirp_spectrum_;
+};
+
+/// Transforms a row-major "row_plan.size()" x "column_plan.size()" array in
+/// place, splitting rows and columns across "pool" if given. The inverse
+/// transform is normalized.
+void transform_2d(std::vector<std::complex<double>> &data,
+                  const Plan &row_plan, const Plan &column_plan, bool inverse,
+                  utility::ThreadPool *pool = nullptr);
+}  // namespace fft
+
+#endif
@@ -39,9 +39,21 @@ int main(int argc, char **argv) {
 
   if (args.generate_blue_noise_) {
     std::cout << "Generating blue_noise..." << std::endl;
-    image::Bl bl =
-        dither::blue_noise(args.blue_noise_size_, args.blue_noise_size_,
-                           args.threads_, args.use_opencl_, args.use_vulkan_);
+    dither::Options options;
+    options.kernel_radius = args.kernel_radius_;
+    options.kernel_tolerance = args.kernel_tolerance_;
+    options.filter = args.filter_mode_;
+    options.complement_energy = args.complement_energy_;
+    options.fixed_point = args.fixed_point_;
+    options.initial = args.initial_pattern_;
+    options.parallel_swaps = args.parallel_swaps_;
+    options.rank_batch = args.rank_batch_;
+    options.tiled_layout = args.tiled_layout_;
+    options.cl_devices = args.cl_devices_;
+    image::Bl bl = dither::blue_noise(args.blue_noise_size_,
+                                      args.blue_noise_size_, args.threads_,
+                                      args.use_opencl_, args.use_vulkan_,
+                                      options);
     if (!bl.writeToFile(image::file_type::PNG, args.overwrite_file_,
                         args.output_filename_)) {
       std::cout << "ERROR: Failed to write blue-noise to file\n";
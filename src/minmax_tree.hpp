@@ -0,0 +1,175 @@
+#ifndef DITHERING_MINMAX_TREE_HPP
+#define DITHERING_MINMAX_TREE_HPP
+
+#include <utility>
+#include <vector>
+
+#include "pattern.hpp"
+#include "utility.hpp"
+
+namespace dither {
+namespace internal {
+/// Tournament tree over the energy field (float or fixed-point) that keeps
+/// the index of the min and max energy among unset and among set pixels of a
+/// Pattern. Changing a range of pixels costs O(range + log N) and queries are
+/// O(1). Ties go to the lowest index, matching the linear scan of
+/// filter_minmax().
+class MinMaxTree {
+ public:
+  MinMaxTree();
+  explicit MinMaxTree(int size);
+
+  /// Recomputes every node. With a "pool", disjoint subtrees are rebuilt in
+  /// parallel and only the nodes above them serially. The tree has the same
+  /// shape for any thread count, so the result does not depend on it.
+  template <typename T>
+  void rebuild(const std::vector<T> &filter, const Pattern &pbp,
+               utility::ThreadPool *pool = nullptr);
+
+  /// Recomputes the leaves [begin, end) and their ancestors after their
+  /// energies or pattern bits changed.
+  template <typename T>
+  void update(const std::vector<T> &filter, const Pattern &pbp, int begin,
+              int end);
+
+  /// Same result as filter_minmax(filter, pbp): the min energy among the
+  /// non-minority pixels and the max energy among the minority pixels.
+  std::pair<int, int> minmax(const Pattern &pbp) const {
+    const Node &root = nodes_[1];
+    if (pbp.count() * 2 < pbp.size()) {
+      return {root.min_unset, root.max_set};
+    } else {
+      return {root.min_set, root.max_unset};
+    }
+  }
+
+ private:
+  struct Node {
+    int min_unset;
+    int max_unset;
+    int min_set;
+    int max_set;
+  };
+
+  template <typename T>
+  static int pick_min(const std::vector<T> &filter, int a, int b) {
+    if (a < 0) {
+      return b;
+    } else if (b < 0) {
+      return a;
+    } else if (filter[b] < filter[a] || (filter[b] == filter[a] && b < a)) {
+      return b;
+    }
+    return a;
+  }
+
+  template <typename T>
+  static int pick_max(const std::vector<T> &filter, int a, int b) {
+    if (a < 0) {
+      return b;
+    } else if (b < 0) {
+      return a;
+    } else if (filter[b] > filter[a] || (filter[b] == filter[a] && b < a)) {
+      return b;
+    }
+    return a;
+  }
+
+  void set_leaf(const Pattern &pbp, int idx) {
+    Node &leaf = nodes_[leaves_ + idx];
+    if (idx >= size_) {
+      leaf = Node{-1, -1, -1, -1};
+    } else if (pbp[idx]) {
+      leaf = Node{-1, -1, idx, idx};
+    } else {
+      leaf = Node{idx, idx, -1, -1};
+    }
+  }
+
+  template <typename T>
+  void merge(const std::vector<T> &filter, int node) {
+    const Node &left = nodes_[node * 2];
+    const Node &right = nodes_[node * 2 + 1];
+    nodes_[node] = Node{pick_min(filter, left.min_unset, right.min_unset),
+                        pick_max(filter, left.max_unset, right.max_unset),
+                        pick_min(filter, left.min_set, right.min_set),
+                        pick_max(filter, left.max_set, right.max_set)};
+  }
+
+  int size_;
+  int leaves_;
+  std::vector<Node> nodes_;
+};
+
+inline MinMaxTree::MinMaxTree() : size_(0), leaves_(1), nodes_(2) {}
+
+inline MinMaxTree::MinMaxTree(int size) : size_(size), leaves_(1), nodes_() {
+  while (leaves_ < size_) {
+    leaves_ *= 2;
+  }
+  nodes_.resize(leaves_ * 2, Node{-1, -1, -1, -1});
+}
+
+template <typename T>
+inline void MinMaxTree::rebuild(const std::vector<T> &filter,
+                                const Pattern &pbp,
+                                utility::ThreadPool *pool) {
+  // Split the leaves into a power of two count of subtrees, their roots are
+  // the nodes [subtrees, 2 * subtrees).
+  int subtrees = 1;
+  while (pool && subtrees * 2 <= (int)pool->size() && subtrees * 2 <= leaves_) {
+    subtrees *= 2;
+  }
+  const int subtree_leaves = leaves_ / subtrees;
+
+  const auto build_subtrees = [&](int first, int last) {
+    for (int subtree = first; subtree < last; ++subtree) {
+      const int begin = subtree * subtree_leaves;
+      for (int i = begin; i < begin + subtree_leaves; ++i) {
+        set_leaf(pbp, i);
+      }
+      int low = (leaves_ + begin) / 2;
+      int high = (leaves_ + begin + subtree_leaves - 1) / 2;
+      while (low >= subtrees) {
+        for (int node = low; node <= high; ++node) {
+          merge(filter, node);
+        }
+        low /= 2;
+        high /= 2;
+      }
+    }
+  };
+  if (subtrees > 1) {
+    pool->parallel_for(0, subtrees, build_subtrees);
+  } else {
+    build_subtrees(0, 1);
+  }
+
+  for (int node = subtrees - 1; node > 0; --node) {
+    merge(filter, node);
+  }
+}
+
+template <typename T>
+inline void MinMaxTree::update(const std::vector<T> &filter,
+                               const Pattern &pbp, int begin, int end) {
+  if (end <= begin) {
+    return;
+  }
+  for (int i = begin; i < end; ++i) {
+    set_leaf(pbp, i);
+  }
+  int low = (leaves_ + begin) / 2;
+  int high = (leaves_ + end - 1) / 2;
+  while (low > 0) {
+    for (int node = low; node <= high; ++node) {
+      merge(filter, node);
+    }
+    low /= 2;
+    high /= 2;
+  }
+}
+}  // namespace internal
+}  // namespace dither
+
+#endif
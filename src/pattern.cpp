@@ -0,0 +1,49 @@
+#include "pattern.hpp"
+
+#include <bitset>
+
+dither::internal::Pattern::Pattern()
+    : size_(0), count_(0), bytes_(), words_() {}
+
+dither::internal::Pattern::Pattern(const std::vector<bool> &pbp)
+    : size_(pbp.size()),
+      count_(0),
+      bytes_(pbp.size()),
+      words_((pbp.size() + 63) / 64, 0) {
+  for (int i = 0; i < size_; ++i) {
+    if (pbp[i]) {
+      bytes_[i] = 1;
+      words_[i / 64] |= std::uint64_t(1) << (i % 64);
+    }
+  }
+  for (std::uint64_t word : words_) {
+    count_ += std::bitset<64>(word).count();
+  }
+}
+
+void dither::internal::Pattern::invert() {
+  for (auto &byte : bytes_) {
+    byte ^= 1;
+  }
+  for (auto &word : words_) {
+    word = ~word;
+  }
+  // Keep the unused bits of the last word cleared.
+  if (size_ % 64 != 0) {
+    words_.back() &= (std::uint64_t(1) << (size_ % 64)) - 1;
+  }
+  count_ = size_ - count_;
+}
+
+std::vector<bool> dither::internal::Pattern::to_vector() const {
+  std::vector<bool> pbp(size_);
+  for (int i = 0; i < size_; ++i) {
+    pbp[i] = bytes_[i] != 0;
+  }
+  return pbp;
+}
+
+bool dither::internal::Pattern::operator==(const Pattern &other) const {
+  return size_ == other.size_ && count_ == other.count_ &&
+         words_ == other.words_;
+}
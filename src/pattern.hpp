@@ -0,0 +1,91 @@
+#ifndef DITHERING_PATTERN_HPP
+#define DITHERING_PATTERN_HPP
+
+#include <cstdint>
+#include <vector>
+
+namespace dither {
+namespace internal {
+class PatternView;
+
+/// Binary pattern ("pbp") storage for the CPU engine. Pixels are kept both as
+/// one byte per pixel, for gathers in the filter loops, and as a packed
+/// bitset, for bulk operations. The count of set pixels is kept up to date on
+/// every change.
+class Pattern {
+ public:
+  Pattern();
+  explicit Pattern(const std::vector<bool> &pbp);
+
+  int size() const { return size_; }
+  /// Number of set pixels.
+  int count() const { return count_; }
+
+  bool operator[](int idx) const { return bytes_[idx] != 0; }
+
+  void set(int idx, bool value) {
+    if ((bytes_[idx] != 0) == value) {
+      return;
+    }
+    bytes_[idx] = value ? 1 : 0;
+    words_[idx / 64] ^= std::uint64_t(1) << (idx % 64);
+    count_ += value ? 1 : -1;
+  }
+
+  const std::uint8_t *bytes() const { return bytes_.data(); }
+  const std::vector<std::uint64_t> &words() const { return words_; }
+
+  /// Flips every pixel.
+  void invert();
+
+  /// View of this pattern with every pixel flipped, without copying.
+  PatternView reversed() const;
+
+  std::vector<bool> to_vector() const;
+
+  bool operator==(const Pattern &other) const;
+  bool operator!=(const Pattern &other) const { return !(*this == other); }
+
+ private:
+  int size_;
+  int count_;
+  std::vector<std::uint8_t> bytes_;
+  std::vector<std::uint64_t> words_;
+};
+
+/// Read-only view of a Pattern, optionally with every pixel flipped.
+class PatternView {
+ public:
+  // Implicit so a Pattern can be passed wherever a view is expected.
+  PatternView(const Pattern &pattern, bool reversed = false)
+      : pattern_(&pattern), reversed_(reversed) {}
+
+  int size() const { return pattern_->size(); }
+  int count() const {
+    return reversed_ ? pattern_->size() - pattern_->count()
+                     : pattern_->count();
+  }
+
+  bool operator[](int idx) const {
+    return (pattern_->bytes()[idx] != 0) != reversed_;
+  }
+
+  bool is_reversed() const { return reversed_; }
+  const Pattern &pattern() const { return *pattern_; }
+
+  /// Value of the pixels filter_minmax() treats as the minority, false when
+  /// exactly half of the pixels are set.
+  bool minority_value() const { return count() * 2 < size(); }
+
+ private:
+  const Pattern *pattern_;
+  bool reversed_;
+};
+
+inline PatternView Pattern::reversed() const {
+  return PatternView(*this, true);
+}
+}  // namespace internal
+}  // namespace dither
+
+#endif
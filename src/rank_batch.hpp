@@ -0,0 +1,279 @@
+#ifndef DITHERING_RANK_BATCH_HPP
+#define DITHERING_RANK_BATCH_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "utility.hpp"
+
+namespace dither {
+namespace internal {
+/// Minimum distance between pixels ranked in the same step of the
+/// approximate ranking: the kernel radius, or the mean spacing of the
+/// "minority" pixels out of "size" once they are sparser than that.
+inline int rank_batch_separation(int size, int minority, int filter_size) {
+  const int spacing =
+      (int)std::ceil(std::sqrt(size / (double)std::max(1, minority)));
+  return std::max({filter_size / 2, spacing, 1});
+}
+
+/// Reports how the approximate ranking of "count" pixels went.
+inline void print_rank_batch_stats(int count, int steps, int out_of_order) {
+  printf(
+      "Approximate ranking took %d steps for %d ranks (%.1f per step), "
+      "about %d (%.3f%%) out of exact order\n",
+      steps, count, count / (double)std::max(1, steps), out_of_order,
+      out_of_order * 100.0 / count);
+}
+
+/// Picks the pixels ranked together in one step of the approximate ranking:
+/// candidates (pixels whose bit is "candidate_value") with the largest
+/// ("want_max") or smallest energies, at least "separation" apart. The torus
+/// is cut into tiles at least "separation" wide that each keep their extreme
+/// candidate, and tile extremes are taken in energy order, lowest index first
+/// on ties, skipping those too close to an earlier pick. At most a quarter of
+/// the tiles are picked per step.
+///
+/// Only the tiles next to the previous step's picks are rescanned, so every
+/// pick must be ranked before the next step, and invalidate_all() must be
+/// called after any other change to the energies or the pattern.
+class RankBatchPicker {
+ public:
+  RankBatchPicker();
+
+  /// Makes the next pick() rescan every tile.
+  void invalidate_all() { separation_ = 0; }
+
+  /// Fills "picks" with up to "max_picks" pixels for one step. Ranking a pick
+  /// moves the energies around it away from the extreme, like every step of
+  /// the exact ranking. Returns how many picks that would have moved past the
+  /// best candidate left for a later step, an estimate of the picks out of
+  /// exact order.
+  template <typename Geometry, typename Energy, typename PatternT>
+  int pick(const Geometry &torus, const Energy *filter, const PatternT &pbp,
+           bool candidate_value, bool want_max, int separation, int max_picks,
+           const std::vector<Energy> &taps, utility::ThreadPool *pool,
+           std::vector<int> &picks);
+
+ private:
+  /// Calls fn(tile) once for each tile in the 3x3 block around "tile".
+  /// Pixels less than "separation" apart are always in such a block.
+  template <typename Fn>
+  void for_each_neighbor(int tile, Fn &&fn) const {
+    const int column_span = std::min(columns_, 3);
+    const int row_span = std::min(rows_, 3);
+    const int column = tile % columns_ - (column_span == 3 ? 1 : 0);
+    const int row = tile / columns_ - (row_span == 3 ? 1 : 0);
+    for (int dy = 0; dy < row_span; ++dy) {
+      for (int dx = 0; dx < column_span; ++dx) {
+        fn((column + dx + columns_) % columns_ +
+           (row + dy + rows_) % rows_ * columns_);
+      }
+    }
+  }
+
+  template <typename Geometry>
+  int tile_of(const Geometry &torus, int idx) const {
+    // The tile "c" covers [c * width / columns, (c + 1) * width / columns).
+    const int column =
+        ((torus.x_of(idx) + 1) * columns_ - 1) / torus.width();
+    const int row = ((torus.y_of(idx) + 1) * rows_ - 1) / torus.height();
+    return column + row * columns_;
+  }
+
+  bool candidate_value_;
+  bool want_max_;
+  int separation_;
+  int columns_;
+  int rows_;
+  std::vector<int> extremes_;
+  std::vector<char> dirty_;
+  std::vector<int> dirty_tiles_;
+  std::vector<int> order_;
+  // Position in "picks" of the pixel picked in each tile, or -1.
+  std::vector<int> picked_;
+};
+
+inline RankBatchPicker::RankBatchPicker()
+    : candidate_value_(false),
+      want_max_(false),
+      separation_(0),
+      columns_(1),
+      rows_(1),
+      extremes_(),
+      dirty_(),
+      dirty_tiles_(),
+      order_(),
+      picked_() {}
+
+template <typename Geometry, typename Energy, typename PatternT>
+inline int RankBatchPicker::pick(const Geometry &torus, const Energy *filter,
+                                 const PatternT &pbp, bool candidate_value,
+                                 bool want_max, int separation, int max_picks,
+                                 const std::vector<Energy> &taps,
+                                 utility::ThreadPool *pool,
+                                 std::vector<int> &picks) {
+  const int width = torus.width();
+  const int height = torus.height();
+  if (separation != separation_ || candidate_value != candidate_value_ ||
+      want_max != want_max_) {
+    candidate_value_ = candidate_value;
+    want_max_ = want_max;
+    separation_ = separation;
+    columns_ = std::max(1, width / separation);
+    rows_ = std::max(1, height / separation);
+    extremes_.assign(columns_ * rows_, -1);
+    dirty_.assign(columns_ * rows_, 1);
+    dirty_tiles_.resize(columns_ * rows_);
+    for (int tile = 0; tile < columns_ * rows_; ++tile) {
+      dirty_tiles_[tile] = tile;
+    }
+  }
+  const int tiles = columns_ * rows_;
+
+  const auto more_extreme = [&](int a, int b) {
+    if (filter[a] != filter[b]) {
+      return want_max ? filter[a] > filter[b] : filter[a] < filter[b];
+    }
+    return a < b;
+  };
+  const auto scan_tiles = [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const int tile = dirty_tiles_[i];
+      const int column = tile % columns_;
+      const int row = tile / columns_;
+      const int x_begin = column * width / columns_;
+      const int x_end = (column + 1) * width / columns_;
+      int extreme = -1;
+      for (int y = row * height / rows_; y < (row + 1) * height / rows_; ++y) {
+        // Tiles never wrap, so in a row-major layout each tile row is a
+        // contiguous run.
+        const int row_begin = torus.index(x_begin, y);
+        for (int x = x_begin; x < x_end; ++x) {
+          const int idx = Geometry::is_tiled ? torus.index(x, y)
+                                             : row_begin + x - x_begin;
+          if (pbp[idx] == candidate_value &&
+              (extreme < 0 || more_extreme(idx, extreme))) {
+            extreme = idx;
+          }
+        }
+      }
+      extremes_[tile] = extreme;
+      dirty_[tile] = 0;
+    }
+  };
+  if (pool) {
+    pool->parallel_for(0, dirty_tiles_.size(), scan_tiles);
+  } else {
+    scan_tiles(0, dirty_tiles_.size());
+  }
+  dirty_tiles_.clear();
+
+  order_.clear();
+  for (int tile = 0; tile < tiles; ++tile) {
+    if (extremes_[tile] >= 0) {
+      order_.push_back(tile);
+    }
+  }
+  const auto by_energy = [&](int a, int b) {
+    return more_extreme(extremes_[a], extremes_[b]);
+  };
+  // Only the front of the order is usually needed, the rest is sorted if
+  // enough tile extremes get skipped.
+  const int limit = std::min(max_picks, std::max(1, tiles / 4));
+  std::size_t sorted = std::min(order_.size(), (std::size_t)limit * 4);
+  std::partial_sort(order_.begin(), order_.begin() + sorted, order_.end(),
+                    by_energy);
+
+  const auto distance_squared = [&](int a, int b) {
+    int dx = std::abs(torus.x_of(a) - torus.x_of(b));
+    int dy = std::abs(torus.y_of(a) - torus.y_of(b));
+    dx = std::min(dx, width - dx);
+    dy = std::min(dy, height - dy);
+    return dx * dx + dy * dy;
+  };
+  picked_.assign(tiles, -1);
+  picks.clear();
+  int runner_up = -1;
+  for (std::size_t i = 0; i < order_.size(); ++i) {
+    if (i == sorted) {
+      std::sort(order_.begin() + sorted, order_.end(), by_energy);
+      sorted = order_.size();
+    }
+    const int tile = order_[i];
+    const int candidate = extremes_[tile];
+    if ((int)picks.size() == limit) {
+      if (runner_up < 0) {
+        runner_up = candidate;
+      }
+      break;
+    }
+    bool too_close = false;
+    for_each_neighbor(tile, [&](int other) {
+      too_close = too_close ||
+                  (picked_[other] >= 0 &&
+                   distance_squared(picks[picked_[other]], candidate) <
+                       separation * separation);
+    });
+    if (too_close) {
+      if (runner_up < 0) {
+        runner_up = candidate;
+      }
+    } else {
+      picked_[tile] = picks.size();
+      picks.push_back(candidate);
+    }
+  }
+
+  for (int idx : picks) {
+    for_each_neighbor(tile_of(torus, idx), [&](int tile) {
+      if (!dirty_[tile]) {
+        dirty_[tile] = 1;
+        dirty_tiles_.push_back(tile);
+      }
+    });
+  }
+
+  if (runner_up < 0) {
+    return 0;
+  }
+  const int filter_size = torus.filter_size();
+  const int radius = filter_size / 2;
+  // Energy ranking the first "before" picks moves "target" by.
+  const auto shift = [&](int target, int before) {
+    Energy sum = 0;
+    for_each_neighbor(tile_of(torus, target), [&](int tile) {
+      if (picked_[tile] < 0 || picked_[tile] >= before) {
+        return;
+      }
+      const int from = picks[picked_[tile]];
+      const int dx =
+          torus.wrap_x(torus.x_of(target) - torus.x_of(from) + radius);
+      const int dy =
+          torus.wrap_y(torus.y_of(target) - torus.y_of(from) + radius);
+      if (dx < filter_size && dy < filter_size) {
+        sum += taps[dx + dy * filter_size];
+      }
+    });
+    return sum;
+  };
+  int out_of_order = 0;
+  for (int j = 1; j < (int)picks.size(); ++j) {
+    const Energy pick_shift = shift(picks[j], j);
+    const Energy runner_up_shift = shift(runner_up, j);
+    if (want_max ? filter[picks[j]] - pick_shift <
+                       filter[runner_up] - runner_up_shift
+                 : filter[picks[j]] + pick_shift >
+                       filter[runner_up] + runner_up_shift) {
+      ++out_of_order;
+    }
+  }
+  return out_of_order;
+}
+}  // namespace internal
+}  // namespace dither
+
+#endif
@@ -0,0 +1,393 @@
+#include "simd.hpp"
+
+#include <cstring>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DITHERING_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define DITHERING_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+constexpr float infinity = std::numeric_limits<float>::infinity();
+
+struct Kernels {
+  const char *name;
+  void (*axpy)(float *, const float *, float, int);
+  std::pair<int, int> (*masked_minmax)(const float *, const std::uint8_t *,
+                                       int, std::uint8_t);
+};
+
+void axpy_scalar(float *out, const float *in, float scale, int count) {
+  for (int i = 0; i < count; ++i) {
+    out[i] += scale * in[i];
+  }
+}
+
+std::pair<int, int> masked_minmax_scalar(const float *values,
+                                         const std::uint8_t *bytes, int count,
+                                         std::uint8_t target) {
+  float min = infinity;
+  float max = -infinity;
+  int min_index = -1;
+  int max_index = -1;
+
+  for (int i = 0; i < count; ++i) {
+    if (bytes[i] != target && values[i] < min) {
+      min_index = i;
+      min = values[i];
+    }
+    if (bytes[i] == target && values[i] > max) {
+      max_index = i;
+      max = values[i];
+    }
+  }
+
+  return {min_index, max_index};
+}
+
+#if defined(DITHERING_SIMD_X86) || defined(DITHERING_SIMD_NEON)
+// The vector kernels first reduce the extreme values, then look for the first
+// index holding each of them so ties resolve like masked_minmax_scalar(). This
+// finishes that second pass from "begin" for whatever is still missing.
+void find_first_extremes(const float *values, const std::uint8_t *bytes,
+                         int begin, int count, std::uint8_t target, float min,
+                         float max, bool need_min, bool need_max,
+                         std::pair<int, int> &result) {
+  for (int i = begin; (need_min || need_max) && i < count; ++i) {
+    if (need_min && bytes[i] != target && values[i] == min) {
+      result.first = i;
+      need_min = false;
+    }
+    if (need_max && bytes[i] == target && values[i] == max) {
+      result.second = i;
+      need_max = false;
+    }
+  }
+}
+
+// Scalar tail of the first pass.
+void reduce_extremes(const float *values, const std::uint8_t *bytes, int begin,
+                     int count, std::uint8_t target, float &min, float &max) {
+  for (int i = begin; i < count; ++i) {
+    if (bytes[i] != target) {
+      min = values[i] < min ? values[i] : min;
+    } else {
+      max = values[i] > max ? values[i] : max;
+    }
+  }
+}
+#endif
+
+#ifdef DITHERING_SIMD_X86
+__attribute__((target("sse4.2"))) void axpy_sse42(float *out, const float *in,
+                                                  float scale, int count) {
+  const __m128 scale_v = _mm_set1_ps(scale);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128 product = _mm_mul_ps(scale_v, _mm_loadu_ps(in + i));
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), product));
+  }
+  axpy_scalar(out + i, in + i, scale, count - i);
+}
+
+__attribute__((target("sse4.2"))) __m128 sse42_target_mask(
+    const std::uint8_t *bytes, __m128i target_v) {
+  int packed;
+  std::memcpy(&packed, bytes, sizeof(packed));
+  return _mm_castsi128_ps(_mm_cmpeq_epi32(
+      _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)), target_v));
+}
+
+__attribute__((target("sse4.2"))) std::pair<int, int> masked_minmax_sse42(
+    const float *values, const std::uint8_t *bytes, int count,
+    std::uint8_t target) {
+  const __m128i target_v = _mm_set1_epi32(target);
+  const __m128 infinity_v = _mm_set1_ps(infinity);
+  const __m128 neg_infinity_v = _mm_set1_ps(-infinity);
+
+  __m128 min_v = infinity_v;
+  __m128 max_v = neg_infinity_v;
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128 value = _mm_loadu_ps(values + i);
+    const __m128 is_target = sse42_target_mask(bytes + i, target_v);
+    min_v = _mm_min_ps(min_v, _mm_blendv_ps(value, infinity_v, is_target));
+    max_v = _mm_max_ps(max_v, _mm_blendv_ps(neg_infinity_v, value, is_target));
+  }
+  float mins[4];
+  float maxs[4];
+  _mm_storeu_ps(mins, min_v);
+  _mm_storeu_ps(maxs, max_v);
+  float min = infinity;
+  float max = -infinity;
+  for (int lane = 0; lane < 4; ++lane) {
+    min = mins[lane] < min ? mins[lane] : min;
+    max = maxs[lane] > max ? maxs[lane] : max;
+  }
+  reduce_extremes(values, bytes, i, count, target, min, max);
+
+  std::pair<int, int> result{-1, -1};
+  bool need_min = min < infinity;
+  bool need_max = max > -infinity;
+  const __m128 min_splat = _mm_set1_ps(min);
+  const __m128 max_splat = _mm_set1_ps(max);
+  i = 0;
+  for (; (need_min || need_max) && i + 4 <= count; i += 4) {
+    const __m128 value = _mm_loadu_ps(values + i);
+    const __m128 is_target = sse42_target_mask(bytes + i, target_v);
+    const int min_bits = _mm_movemask_ps(
+        _mm_andnot_ps(is_target, _mm_cmpeq_ps(value, min_splat)));
+    const int max_bits =
+        _mm_movemask_ps(_mm_and_ps(is_target, _mm_cmpeq_ps(value, max_splat)));
+    if (need_min && min_bits != 0) {
+      result.first = i + __builtin_ctz(min_bits);
+      need_min = false;
+    }
+    if (need_max && max_bits != 0) {
+      result.second = i + __builtin_ctz(max_bits);
+      need_max = false;
+    }
+  }
+  find_first_extremes(values, bytes, i, count, target, min, max, need_min,
+                      need_max, result);
+  return result;
+}
+
+__attribute__((target("avx2"))) void axpy_avx2(float *out, const float *in,
+                                               float scale, int count) {
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 product = _mm256_mul_ps(scale_v, _mm256_loadu_ps(in + i));
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), product));
+  }
+  axpy_scalar(out + i, in + i, scale, count - i);
+}
+
+__attribute__((target("avx2"))) __m256 avx2_target_mask(
+    const std::uint8_t *bytes, __m256i target_v) {
+  const __m128i packed =
+      _mm_loadl_epi64(reinterpret_cast<const __m128i *>(bytes));
+  return _mm256_castsi256_ps(
+      _mm256_cmpeq_epi32(_mm256_cvtepu8_epi32(packed), target_v));
+}
+
+__attribute__((target("avx2"))) std::pair<int, int> masked_minmax_avx2(
+    const float *values, const std::uint8_t *bytes, int count,
+    std::uint8_t target) {
+  const __m256i target_v = _mm256_set1_epi32(target);
+  const __m256 infinity_v = _mm256_set1_ps(infinity);
+  const __m256 neg_infinity_v = _mm256_set1_ps(-infinity);
+
+  __m256 min_v = infinity_v;
+  __m256 max_v = neg_infinity_v;
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 value = _mm256_loadu_ps(values + i);
+    const __m256 is_target = avx2_target_mask(bytes + i, target_v);
+    min_v =
+        _mm256_min_ps(min_v, _mm256_blendv_ps(value, infinity_v, is_target));
+    max_v = _mm256_max_ps(max_v,
+                          _mm256_blendv_ps(neg_infinity_v, value, is_target));
+  }
+  float mins[8];
+  float maxs[8];
+  _mm256_storeu_ps(mins, min_v);
+  _mm256_storeu_ps(maxs, max_v);
+  float min = infinity;
+  float max = -infinity;
+  for (int lane = 0; lane < 8; ++lane) {
+    min = mins[lane] < min ? mins[lane] : min;
+    max = maxs[lane] > max ? maxs[lane] : max;
+  }
+  reduce_extremes(values, bytes, i, count, target, min, max);
+
+  std::pair<int, int> result{-1, -1};
+  bool need_min = min < infinity;
+  bool need_max = max > -infinity;
+  const __m256 min_splat = _mm256_set1_ps(min);
+  const __m256 max_splat = _mm256_set1_ps(max);
+  i = 0;
+  for (; (need_min || need_max) && i + 8 <= count; i += 8) {
+    const __m256 value = _mm256_loadu_ps(values + i);
+    const __m256 is_target = avx2_target_mask(bytes + i, target_v);
+    const int min_bits = _mm256_movemask_ps(_mm256_andnot_ps(
+        is_target, _mm256_cmp_ps(value, min_splat, _CMP_EQ_OQ)));
+    const int max_bits = _mm256_movemask_ps(_mm256_and_ps(
+        is_target, _mm256_cmp_ps(value, max_splat, _CMP_EQ_OQ)));
+    if (need_min && min_bits != 0) {
+      result.first = i + __builtin_ctz(min_bits);
+      need_min = false;
+    }
+    if (need_max && max_bits != 0) {
+      result.second = i + __builtin_ctz(max_bits);
+      need_max = false;
+    }
+  }
+  find_first_extremes(values, bytes, i, count, target, min, max, need_min,
+                      need_max, result);
+  return result;
+}
+
+__attribute__((target("avx512f"))) void axpy_avx512(float *out,
+                                                    const float *in,
+                                                    float scale, int count) {
+  const __m512 scale_v = _mm512_set1_ps(scale);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m512 product = _mm512_mul_ps(scale_v, _mm512_loadu_ps(in + i));
+    _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(out + i), product));
+  }
+  axpy_scalar(out + i, in + i, scale, count - i);
+}
+
+__attribute__((target("avx512f"))) __mmask16 avx512_target_mask(
+    const std::uint8_t *bytes, __m512i target_v) {
+  const __m128i packed =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+  // The maskz form avoids the undefined source operand of the plain one,
+  // which trips -Wuninitialized in some GCC versions.
+  return _mm512_cmpeq_epi32_mask(_mm512_maskz_cvtepu8_epi32(0xFFFF, packed),
+                                 target_v);
+}
+
+__attribute__((target("avx512f"))) std::pair<int, int> masked_minmax_avx512(
+    const float *values, const std::uint8_t *bytes, int count,
+    std::uint8_t target) {
+  const __m512i target_v = _mm512_set1_epi32(target);
+
+  __m512 min_v = _mm512_set1_ps(infinity);
+  __m512 max_v = _mm512_set1_ps(-infinity);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m512 value = _mm512_loadu_ps(values + i);
+    const __mmask16 is_target = avx512_target_mask(bytes + i, target_v);
+    min_v = _mm512_mask_min_ps(min_v, _mm512_knot(is_target), min_v, value);
+    max_v = _mm512_mask_max_ps(max_v, is_target, max_v, value);
+  }
+  float mins[16];
+  float maxs[16];
+  _mm512_storeu_ps(mins, min_v);
+  _mm512_storeu_ps(maxs, max_v);
+  float min = infinity;
+  float max = -infinity;
+  for (int lane = 0; lane < 16; ++lane) {
+    min = mins[lane] < min ? mins[lane] : min;
+    max = maxs[lane] > max ? maxs[lane] : max;
+  }
+  reduce_extremes(values, bytes, i, count, target, min, max);
+
+  std::pair<int, int> result{-1, -1};
+  bool need_min = min < infinity;
+  bool need_max = max > -infinity;
+  const __m512 min_splat = _mm512_set1_ps(min);
+  const __m512 max_splat = _mm512_set1_ps(max);
+  i = 0;
+  for (; (need_min || need_max) && i + 16 <= count; i += 16) {
+    const __m512 value = _mm512_loadu_ps(values + i);
+    const __mmask16 is_target = avx512_target_mask(bytes + i, target_v);
+    const unsigned int min_bits = _mm512_mask_cmp_ps_mask(
+        _mm512_knot(is_target), value, min_splat, _CMP_EQ_OQ);
+    const unsigned int max_bits =
+        _mm512_mask_cmp_ps_mask(is_target, value, max_splat, _CMP_EQ_OQ);
+    if (need_min && min_bits != 0) {
+      result.first = i + __builtin_ctz(min_bits);
+      need_min = false;
+    }
+    if (need_max && max_bits != 0) {
+      result.second = i + __builtin_ctz(max_bits);
+      need_max = false;
+    }
+  }
+  find_first_extremes(values, bytes, i, count, target, min, max, need_min,
+                      need_max, result);
+  return result;
+}
+#endif  // DITHERING_SIMD_X86
+
+#ifdef DITHERING_SIMD_NEON
+void axpy_neon(float *out, const float *in, float scale, int count) {
+  const float32x4_t scale_v = vdupq_n_f32(scale);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const float32x4_t product = vmulq_f32(scale_v, vld1q_f32(in + i));
+    vst1q_f32(out + i, vaddq_f32(vld1q_f32(out + i), product));
+  }
+  axpy_scalar(out + i, in + i, scale, count - i);
+}
+
+std::pair<int, int> masked_minmax_neon(const float *values,
+                                       const std::uint8_t *bytes, int count,
+                                       std::uint8_t target) {
+  const uint32x4_t target_v = vdupq_n_u32(target);
+  const float32x4_t infinity_v = vdupq_n_f32(infinity);
+  const float32x4_t neg_infinity_v = vdupq_n_f32(-infinity);
+
+  float32x4_t min_v = infinity_v;
+  float32x4_t max_v = neg_infinity_v;
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const uint16x8_t wide = vmovl_u8(vld1_u8(bytes + i));
+    const uint32x4_t low = vceqq_u32(vmovl_u16(vget_low_u16(wide)), target_v);
+    const uint32x4_t high = vceqq_u32(vmovl_u16(vget_high_u16(wide)), target_v);
+    const float32x4_t value_low = vld1q_f32(values + i);
+    const float32x4_t value_high = vld1q_f32(values + i + 4);
+    min_v = vminq_f32(min_v, vbslq_f32(low, infinity_v, value_low));
+    min_v = vminq_f32(min_v, vbslq_f32(high, infinity_v, value_high));
+    max_v = vmaxq_f32(max_v, vbslq_f32(low, value_low, neg_infinity_v));
+    max_v = vmaxq_f32(max_v, vbslq_f32(high, value_high, neg_infinity_v));
+  }
+  float mins[4];
+  float maxs[4];
+  vst1q_f32(mins, min_v);
+  vst1q_f32(maxs, max_v);
+  float min = infinity;
+  float max = -infinity;
+  for (int lane = 0; lane < 4; ++lane) {
+    min = mins[lane] < min ? mins[lane] : min;
+    max = maxs[lane] > max ? maxs[lane] : max;
+  }
+  reduce_extremes(values, bytes, i, count, target, min, max);
+
+  // NEON has no movemask, the early-exiting scalar search is about as fast.
+  std::pair<int, int> result{-1, -1};
+  find_first_extremes(values, bytes, 0, count, target, min, max,
+                      min < infinity, max > -infinity, result);
+  return result;
+}
+#endif  // DITHERING_SIMD_NEON
+
+Kernels select_kernels() {
+#ifdef DITHERING_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return {"AVX-512", axpy_avx512, masked_minmax_avx512};
+  } else if (__builtin_cpu_supports("avx2")) {
+    return {"AVX2", axpy_avx2, masked_minmax_avx2};
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    return {"SSE4.2", axpy_sse42, masked_minmax_sse42};
+  }
+#elif defined(DITHERING_SIMD_NEON)
+  return {"NEON", axpy_neon, masked_minmax_neon};
+#endif
+  return {"scalar", axpy_scalar, masked_minmax_scalar};
+}
+
+const Kernels kernels = select_kernels();
+}  // namespace
+
+const char *simd::isa_name() { return kernels.name; }
+
+void simd::axpy(float *out, const float *in, float scale, int count) {
+  kernels.axpy(out, in, scale, count);
+}
+
+std::pair<int, int> simd::masked_minmax(const float *values,
+                                        const std::uint8_t *bytes, int count,
+                                        std::uint8_t target) {
+  return kernels.masked_minmax(values, bytes, count, target);
+}
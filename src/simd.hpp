@@ -0,0 +1,24 @@
+#ifndef DITHERING_SIMD_HPP
+#define DITHERING_SIMD_HPP
+
+#include <cstdint>
+#include <utility>
+
+namespace simd {
+/// Name of the instruction set the kernels below were picked for at startup,
+/// one of "AVX-512", "AVX2", "SSE4.2", "NEON" or "scalar".
+const char *isa_name();
+
+/// out[i] += scale * in[i] for every i in [0, count).
+void axpy(float *out, const float *in, float scale, int count);
+
+/// Returns the index of the smallest of values[i] where bytes[i] != target and
+/// of the largest of values[i] where bytes[i] == target, or -1 when there is
+/// none. "bytes" and "target" must be 0 or 1. Ties go to the lowest index,
+/// like a linear scan with strict compares.
+std::pair<int, int> masked_minmax(const float *values,
+                                  const std::uint8_t *bytes, int count,
+                                  std::uint8_t target);
+}  // namespace simd
+
+#endif
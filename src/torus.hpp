@@ -0,0 +1,147 @@
+#ifndef DITHERING_TORUS_HPP
+#define DITHERING_TORUS_HPP
+
+namespace dither {
+namespace internal {
+/// Image and kernel window sizes of the CPU engine, known only at runtime.
+/// Coordinates wrap around both edges.
+class Torus {
+ public:
+  static constexpr bool is_fixed = false;
+  static constexpr bool is_tiled = false;
+
+  Torus(int width, int height, int filter_size)
+      : width_(width),
+        height_(height),
+        filter_size_(filter_size % 2 == 0 ? filter_size + 1 : filter_size) {}
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  int size() const { return width_ * height_; }
+  /// Always odd.
+  int filter_size() const { return filter_size_; }
+
+  int wrap_x(int x) const {
+    x %= width_;
+    return x < 0 ? x + width_ : x;
+  }
+  int wrap_y(int y) const {
+    y %= height_;
+    return y < 0 ? y + height_ : y;
+  }
+
+  int x_of(int idx) const { return idx % width_; }
+  int y_of(int idx) const { return idx / width_; }
+  int index(int x, int y) const { return wrap_x(x) + wrap_y(y) * width_; }
+
+ private:
+  int width_;
+  int height_;
+  int filter_size_;
+};
+
+/// Square power-of-two image with a kernel window fixed at compile time.
+/// Wrapping is a mask and row offsets are shifts, and loops over the window
+/// have constant trip counts the compiler can unroll.
+template <int Size, int FilterSize>
+class FixedTorus {
+ public:
+  static_assert(Size > 0 && (Size & (Size - 1)) == 0,
+                "FixedTorus size must be a power of two");
+  static_assert(FilterSize % 2 == 1 && FilterSize <= Size,
+                "FixedTorus filter size must be odd and fit the image");
+
+  static constexpr bool is_fixed = true;
+  static constexpr bool is_tiled = false;
+
+  static constexpr int width() { return Size; }
+  static constexpr int height() { return Size; }
+  static constexpr int size() { return Size * Size; }
+  static constexpr int filter_size() { return FilterSize; }
+
+  static constexpr int wrap_x(int x) { return x & (Size - 1); }
+  static constexpr int wrap_y(int y) { return y & (Size - 1); }
+
+  static constexpr int x_of(int idx) { return idx & (Size - 1); }
+  static constexpr int y_of(int idx) { return idx >> log2_size; }
+  static constexpr int index(int x, int y) {
+    return wrap_x(x) | (wrap_y(y) << log2_size);
+  }
+
+ private:
+  static constexpr int compute_log2(int value) {
+    int log = 0;
+    while ((1 << log) < value) {
+      ++log;
+    }
+    return log;
+  }
+
+  static constexpr int log2_size = compute_log2(Size);
+};
+
+/// Torus stored in 8x8 tiles. The tiles are in row-major order and so are the
+/// pixels inside each tile, so a kernel window covers a few contiguous tiles
+/// instead of "filter_size" rows far apart. Width and height must be
+/// multiples of the tile size, see fits(). Indices only mean something to the
+/// engine, rangeToBl() writes the output back in row-major order.
+class TiledTorus {
+ public:
+  static constexpr bool is_fixed = false;
+  static constexpr bool is_tiled = true;
+  static constexpr int tile_shift = 3;
+  static constexpr int tile_size = 1 << tile_shift;
+
+  TiledTorus(int width, int height, int filter_size)
+      : width_(width),
+        height_(height),
+        filter_size_(filter_size % 2 == 0 ? filter_size + 1 : filter_size),
+        tiles_x_(width >> tile_shift) {}
+
+  static bool fits(int width, int height) {
+    return width % tile_size == 0 && height % tile_size == 0;
+  }
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  int size() const { return width_ * height_; }
+  /// Always odd.
+  int filter_size() const { return filter_size_; }
+  /// Number of tiles in a row of tiles.
+  int tiles_x() const { return tiles_x_; }
+
+  int wrap_x(int x) const {
+    x %= width_;
+    return x < 0 ? x + width_ : x;
+  }
+  int wrap_y(int y) const {
+    y %= height_;
+    return y < 0 ? y + height_ : y;
+  }
+
+  int x_of(int idx) const {
+    return (idx >> (2 * tile_shift)) % tiles_x_ * tile_size +
+           (idx & (tile_size - 1));
+  }
+  int y_of(int idx) const {
+    return (idx >> (2 * tile_shift)) / tiles_x_ * tile_size +
+           ((idx >> tile_shift) & (tile_size - 1));
+  }
+  int index(int x, int y) const {
+    x = wrap_x(x);
+    y = wrap_y(y);
+    return (((y >> tile_shift) * tiles_x_ + (x >> tile_shift))
+            << (2 * tile_shift)) |
+           ((y & (tile_size - 1)) << tile_shift) | (x & (tile_size - 1));
+  }
+
+ private:
+  int width_;
+  int height_;
+  int filter_size_;
+  int tiles_x_;
+};
+}  // namespace internal
+}  // namespace dither
+
+#endif
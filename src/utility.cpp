@@ -29,3 +29,105 @@ utility::Cleanup &utility::Cleanup::operator=(utility::Cleanup &&other) {
 
   return *this;
 }
+
+utility::ThreadPool::ThreadPool(unsigned int threads)
+    : workers(),
+      mutex(),
+      start_cv(),
+      done_cv(),
+      job(nullptr),
+      job_begin(0),
+      job_end(0),
+      job_chunks(0),
+      generation(0),
+      pending(0),
+      stopping(false) {
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+    if (threads == 0) {
+      threads = 1;
+    }
+  }
+  for (unsigned int i = 1; i < threads; ++i) {
+    workers.emplace_back(&ThreadPool::worker_loop, this, i);
+  }
+}
+
+utility::ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_cv.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+unsigned int utility::ThreadPool::size() const { return workers.size() + 1; }
+
+void utility::ThreadPool::parallel_for(
+    int begin, int end, const std::function<void(int, int)> &fn) {
+  if (end <= begin) {
+    return;
+  }
+  unsigned int chunks = size();
+  if ((unsigned int)(end - begin) < chunks) {
+    chunks = end - begin;
+  }
+  if (chunks == 1) {
+    fn(begin, end);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn;
+    job_begin = begin;
+    job_end = end;
+    job_chunks = chunks;
+    pending = workers.size();
+    ++generation;
+  }
+  start_cv.notify_all();
+
+  run_chunk(0);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [this] { return pending == 0; });
+  job = nullptr;
+}
+
+void utility::ThreadPool::worker_loop(unsigned int index) {
+  unsigned long long seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start_cv.wait(lock, [this, seen_generation] {
+        return stopping || generation != seen_generation;
+      });
+      if (stopping) {
+        return;
+      }
+      seen_generation = generation;
+    }
+
+    run_chunk(index);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --pending;
+    }
+    done_cv.notify_one();
+  }
+}
+
+void utility::ThreadPool::run_chunk(unsigned int index) {
+  if (index >= job_chunks) {
+    return;
+  }
+  long long length = job_end - job_begin;
+  int chunk_begin = job_begin + (int)(length * index / job_chunks);
+  int chunk_end = job_begin + (int)(length * (index + 1) / job_chunks);
+  (*job)(chunk_begin, chunk_end);
+}
@@ -2,9 +2,13 @@
 #define DITHERING_UTILITY_HPP
 
 #include <cmath>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
 #include <optional>
+#include <thread>
 #include <utility>
+#include <vector>
 
 namespace utility {
 inline int twoToOne(int x, int y, int width, int height) {
@@ -49,6 +53,46 @@ class Cleanup {
   std::optional<std::function<void(void *)>> fn;
   void *ptr;
 };
+
+/// Fixed set of worker threads that run one range-splitting job at a time.
+/// The thread calling parallel_for() works on the first chunk itself.
+class ThreadPool {
+ public:
+  /// Uses "threads" threads in total, 0 picks the hardware thread count.
+  explicit ThreadPool(unsigned int threads);
+  ~ThreadPool();
+
+  // deny copy and move, workers hold a pointer to this
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  ThreadPool(ThreadPool &&) = delete;
+  ThreadPool &operator=(ThreadPool &&) = delete;
+
+  /// Number of threads including the calling thread.
+  unsigned int size() const;
+
+  /// Splits [begin, end) into up to size() contiguous chunks, calls
+  /// fn(chunk_begin, chunk_end) for each and returns once all are done.
+  /// Must not be called from within "fn".
+  void parallel_for(int begin, int end,
+                    const std::function<void(int, int)> &fn);
+
+ private:
+  void worker_loop(unsigned int index);
+  void run_chunk(unsigned int index);
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  const std::function<void(int, int)> *job;
+  int job_begin;
+  int job_end;
+  unsigned int job_chunks;
+  unsigned long long generation;
+  unsigned int pending;
+  bool stopping;
+};
 }  // namespace utility
 
 #endif